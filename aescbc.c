@@ -0,0 +1,298 @@
+/*
+ * AES-128 CBC packet decryption. This file is part of Shairport Sync.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "aescbc.h"
+
+/* AES-NI code is built with a target attribute and selected at runtime.
+ * ARMv8 Crypto Extensions code is built when the compiler targets them,
+ * and is selected at runtime where the kernel says the processor has them. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AESCBC_HAVE_AESNI
+#include <cpuid.h>
+#include <wmmintrin.h>
+#endif
+
+#if defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES)
+#define AESCBC_HAVE_ARMV8
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#endif
+#endif
+
+typedef void (*aescbc_kernel)(const uint8_t *round_keys, const uint8_t *iv, uint8_t *buf, int blocks);
+
+static aescbc_kernel hardware_kernel;
+static const char *implementation;
+
+/* The round keys are expanded here rather than by the hardware,
+ * so that both kinds of hardware can share them. */
+
+static inline uint8_t rotl8(uint8_t x, int shift) {
+  return (x << shift) | (x >> (8 - shift));
+}
+
+static void aes_sbox_init(uint8_t sbox[256]) {
+  uint8_t p = 1, q = 1;
+  // p runs through the multiplicative group of GF(2^8), q through the inverses
+  do {
+    p = p ^ (p << 1) ^ (p & 0x80 ? 0x1b : 0);
+    q ^= q << 1;
+    q ^= q << 2;
+    q ^= q << 4;
+    if (q & 0x80)
+      q ^= 0x09;
+    sbox[p] = 0x63 ^ q ^ rotl8(q, 1) ^ rotl8(q, 2) ^ rotl8(q, 3) ^ rotl8(q, 4);
+  } while (p != 1);
+  sbox[0] = 0x63;
+}
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b) {
+  uint8_t r = 0;
+  while (b) {
+    if (b & 1)
+      r ^= a;
+    a = (a << 1) ^ (a & 0x80 ? 0x1b : 0);
+    b >>= 1;
+  }
+  return r;
+}
+
+static void inv_mix_columns(uint8_t *block) {
+  int c;
+  for (c = 0; c < 4; c++) {
+    uint8_t *a = block + 4 * c;
+    uint8_t a0 = a[0], a1 = a[1], a2 = a[2], a3 = a[3];
+    a[0] = gf_mul(a0, 14) ^ gf_mul(a1, 11) ^ gf_mul(a2, 13) ^ gf_mul(a3, 9);
+    a[1] = gf_mul(a0, 9) ^ gf_mul(a1, 14) ^ gf_mul(a2, 11) ^ gf_mul(a3, 13);
+    a[2] = gf_mul(a0, 13) ^ gf_mul(a1, 9) ^ gf_mul(a2, 14) ^ gf_mul(a3, 11);
+    a[3] = gf_mul(a0, 11) ^ gf_mul(a1, 13) ^ gf_mul(a2, 9) ^ gf_mul(a3, 14);
+  }
+}
+
+// the decryption round keys of the equivalent inverse cipher, as AESDEC and AESD want them
+static void expand_decrypt_key(const uint8_t *userkey, uint8_t *round_keys) {
+  uint8_t sbox[256], ek[11 * 16];
+  uint8_t rcon = 1;
+  int i, j;
+
+  aes_sbox_init(sbox);
+  memcpy(ek, userkey, 16);
+  for (i = 16; i < 11 * 16; i += 4) {
+    uint8_t t[4];
+    memcpy(t, ek + i - 4, 4);
+    if (i % 16 == 0) {
+      uint8_t t0 = t[0];
+      t[0] = sbox[t[1]] ^ rcon;
+      t[1] = sbox[t[2]];
+      t[2] = sbox[t[3]];
+      t[3] = sbox[t0];
+      rcon = (rcon << 1) ^ (rcon & 0x80 ? 0x1b : 0);
+    }
+    for (j = 0; j < 4; j++)
+      ek[i + j] = ek[i - 16 + j] ^ t[j];
+  }
+
+  memcpy(round_keys, ek + 10 * 16, 16);
+  for (i = 1; i < 10; i++) {
+    memcpy(round_keys + 16 * i, ek + 16 * (10 - i), 16);
+    inv_mix_columns(round_keys + 16 * i);
+  }
+  memcpy(round_keys + 10 * 16, ek, 16);
+}
+
+#ifdef AESCBC_HAVE_AESNI
+/* CBC decryption can work on several blocks at once, which keeps the AES unit busy */
+__attribute__((target("aes,sse2")))
+static void aescbc_decrypt_aesni(const uint8_t *round_keys, const uint8_t *iv, uint8_t *buf, int blocks) {
+  __m128i rk[11];
+  __m128i prev = _mm_loadu_si128((const __m128i *)iv);
+  int i;
+
+  for (i = 0; i < 11; i++)
+    rk[i] = _mm_loadu_si128((const __m128i *)(round_keys + 16 * i));
+
+  for (; blocks >= 4; blocks -= 4, buf += 64) {
+    __m128i c0 = _mm_loadu_si128((const __m128i *)buf);
+    __m128i c1 = _mm_loadu_si128((const __m128i *)(buf + 16));
+    __m128i c2 = _mm_loadu_si128((const __m128i *)(buf + 32));
+    __m128i c3 = _mm_loadu_si128((const __m128i *)(buf + 48));
+    __m128i s0 = _mm_xor_si128(c0, rk[0]);
+    __m128i s1 = _mm_xor_si128(c1, rk[0]);
+    __m128i s2 = _mm_xor_si128(c2, rk[0]);
+    __m128i s3 = _mm_xor_si128(c3, rk[0]);
+    for (i = 1; i < 10; i++) {
+      s0 = _mm_aesdec_si128(s0, rk[i]);
+      s1 = _mm_aesdec_si128(s1, rk[i]);
+      s2 = _mm_aesdec_si128(s2, rk[i]);
+      s3 = _mm_aesdec_si128(s3, rk[i]);
+    }
+    s0 = _mm_xor_si128(_mm_aesdeclast_si128(s0, rk[10]), prev);
+    s1 = _mm_xor_si128(_mm_aesdeclast_si128(s1, rk[10]), c0);
+    s2 = _mm_xor_si128(_mm_aesdeclast_si128(s2, rk[10]), c1);
+    s3 = _mm_xor_si128(_mm_aesdeclast_si128(s3, rk[10]), c2);
+    prev = c3;
+    _mm_storeu_si128((__m128i *)buf, s0);
+    _mm_storeu_si128((__m128i *)(buf + 16), s1);
+    _mm_storeu_si128((__m128i *)(buf + 32), s2);
+    _mm_storeu_si128((__m128i *)(buf + 48), s3);
+  }
+
+  for (; blocks > 0; blocks--, buf += 16) {
+    __m128i c = _mm_loadu_si128((const __m128i *)buf);
+    __m128i s = _mm_xor_si128(c, rk[0]);
+    for (i = 1; i < 10; i++)
+      s = _mm_aesdec_si128(s, rk[i]);
+    s = _mm_xor_si128(_mm_aesdeclast_si128(s, rk[10]), prev);
+    prev = c;
+    _mm_storeu_si128((__m128i *)buf, s);
+  }
+}
+
+static int have_aesni(void) {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return 0;
+  return (ecx & bit_AES) != 0;
+}
+#endif
+
+#ifdef AESCBC_HAVE_ARMV8
+/* AESD does AddRoundKey, InvShiftRows and InvSubBytes; AESIMC does InvMixColumns */
+static inline uint8x16_t armv8_decrypt_block(const uint8x16_t *rk, uint8x16_t s) {
+  int i;
+  for (i = 0; i < 9; i++)
+    s = vaesimcq_u8(vaesdq_u8(s, rk[i]));
+  return veorq_u8(vaesdq_u8(s, rk[9]), rk[10]);
+}
+
+static void aescbc_decrypt_armv8(const uint8_t *round_keys, const uint8_t *iv, uint8_t *buf, int blocks) {
+  uint8x16_t rk[11];
+  uint8x16_t prev = vld1q_u8(iv);
+  int i;
+
+  for (i = 0; i < 11; i++)
+    rk[i] = vld1q_u8(round_keys + 16 * i);
+
+  for (; blocks >= 4; blocks -= 4, buf += 64) {
+    uint8x16_t c0 = vld1q_u8(buf);
+    uint8x16_t c1 = vld1q_u8(buf + 16);
+    uint8x16_t c2 = vld1q_u8(buf + 32);
+    uint8x16_t c3 = vld1q_u8(buf + 48);
+    uint8x16_t s0 = c0, s1 = c1, s2 = c2, s3 = c3;
+    for (i = 0; i < 9; i++) {
+      s0 = vaesimcq_u8(vaesdq_u8(s0, rk[i]));
+      s1 = vaesimcq_u8(vaesdq_u8(s1, rk[i]));
+      s2 = vaesimcq_u8(vaesdq_u8(s2, rk[i]));
+      s3 = vaesimcq_u8(vaesdq_u8(s3, rk[i]));
+    }
+    s0 = veorq_u8(veorq_u8(vaesdq_u8(s0, rk[9]), rk[10]), prev);
+    s1 = veorq_u8(veorq_u8(vaesdq_u8(s1, rk[9]), rk[10]), c0);
+    s2 = veorq_u8(veorq_u8(vaesdq_u8(s2, rk[9]), rk[10]), c1);
+    s3 = veorq_u8(veorq_u8(vaesdq_u8(s3, rk[9]), rk[10]), c2);
+    prev = c3;
+    vst1q_u8(buf, s0);
+    vst1q_u8(buf + 16, s1);
+    vst1q_u8(buf + 32, s2);
+    vst1q_u8(buf + 48, s3);
+  }
+
+  for (; blocks > 0; blocks--, buf += 16) {
+    uint8x16_t c = vld1q_u8(buf);
+    vst1q_u8(buf, veorq_u8(armv8_decrypt_block(rk, c), prev));
+    prev = c;
+  }
+}
+
+static int have_armv8_aes(void) {
+#if defined(__linux__) && defined(__aarch64__)
+  return (getauxval(AT_HWCAP) & (1 << 3)) != 0; // HWCAP_AES
+#elif defined(__linux__)
+  return (getauxval(AT_HWCAP2) & (1 << 0)) != 0; // HWCAP2_AES
+#else
+  return 1; // built for a target that has them
+#endif
+}
+#endif
+
+static void aescbc_select(void) {
+  if (implementation)
+    return;
+#ifdef AESCBC_HAVE_AESNI
+  if (have_aesni()) {
+    hardware_kernel = aescbc_decrypt_aesni;
+    implementation = "AES-NI";
+    return;
+  }
+#endif
+#ifdef AESCBC_HAVE_ARMV8
+  if (have_armv8_aes()) {
+    hardware_kernel = aescbc_decrypt_armv8;
+    implementation = "ARMv8 Crypto Extensions";
+    return;
+  }
+#endif
+#ifdef HAVE_LIBPOLARSSL
+  implementation = "PolarSSL";
+#endif
+#ifdef HAVE_LIBSSL
+  implementation = "OpenSSL";
+#endif
+}
+
+void aescbc_set_decrypt_key(aescbc_key *key, const uint8_t userkey[16]) {
+  aescbc_select();
+  expand_decrypt_key(userkey, key->round_keys);
+#ifdef HAVE_LIBPOLARSSL
+  memset(&key->dctx, 0, sizeof(aes_context));
+  aes_setkey_dec(&key->dctx, userkey, 128);
+#endif
+#ifdef HAVE_LIBSSL
+  AES_set_decrypt_key(userkey, 128, &key->aes);
+#endif
+}
+
+void aescbc_decrypt(aescbc_key *key, const uint8_t iv[16], uint8_t *buf, int len) {
+  if (hardware_kernel) {
+    hardware_kernel(key->round_keys, iv, buf, len / 16);
+  } else {
+    // both libraries decrypt in place correctly, but update the iv they're given
+    unsigned char ivcopy[16];
+    memcpy(ivcopy, iv, sizeof(ivcopy));
+#ifdef HAVE_LIBPOLARSSL
+    aes_crypt_cbc(&key->dctx, AES_DECRYPT, len, ivcopy, buf, buf);
+#endif
+#ifdef HAVE_LIBSSL
+    AES_cbc_encrypt(buf, buf, len, &key->aes, ivcopy, AES_DECRYPT);
+#endif
+  }
+}
+
+const char *aescbc_implementation(void) {
+  aescbc_select();
+  return implementation;
+}
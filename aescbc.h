@@ -0,0 +1,37 @@
+#ifndef _AESCBC_H
+#define _AESCBC_H
+
+#include <stdint.h>
+#include "config.h"
+
+#ifdef HAVE_LIBPOLARSSL
+#include <polarssl/aes.h>
+#endif
+
+#ifdef HAVE_LIBSSL
+#include <openssl/aes.h>
+#endif
+
+// AES-128 CBC decryption of audio packets, in place.
+// AES-NI or the ARMv8 Crypto Extensions are used if the processor has them,
+// otherwise OpenSSL or PolarSSL.
+
+typedef struct {
+  uint8_t round_keys[11*16]; // decryption round keys, for the hardware
+#ifdef HAVE_LIBPOLARSSL
+  aes_context dctx;
+#endif
+#ifdef HAVE_LIBSSL
+  AES_KEY aes;
+#endif
+} aescbc_key;
+
+void aescbc_set_decrypt_key(aescbc_key *key, const uint8_t userkey[16]);
+
+// len must be a multiple of 16; iv is not changed
+void aescbc_decrypt(aescbc_key *key, const uint8_t iv[16], uint8_t *buf, int len);
+
+// the name of the implementation in use
+const char *aescbc_implementation(void);
+
+#endif // _AESCBC_H
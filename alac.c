@@ -42,6 +42,26 @@ static const int host_bigendian = 0;
 
 #include "alac.h"
 
+/* sse4.1 code is built with a target attribute and selected at runtime,
+ * sse2 and neon are used when the compiler targets them.
+ * ALAC_GENERIC builds only the plain c code, so that it can be tested */
+#ifndef ALAC_GENERIC
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ALAC_HAVE_SSE41
+#include <smmintrin.h>
+#endif
+
+#if defined(__SSE2__)
+#define ALAC_HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define ALAC_HAVE_NEON
+#include <arm_neon.h>
+#endif
+#endif /* ALAC_GENERIC */
+
 #define _Swap32(v) do { \
                    v = (((v) & 0x000000FF) << 0x18) | \
                        (((v) & 0x0000FF00) << 0x08) | \
@@ -56,34 +76,36 @@ struct {signed int x:24;} se_struct_24;
 #define SignExtend24(val) (se_struct_24.x = val)
 
 void alac_free(alac_file *alac) {
-    if (alac->predicterror_buffer_a)
-        free(alac->predicterror_buffer_a);
-    if (alac->predicterror_buffer_b)
-        free(alac->predicterror_buffer_b);
-
-    if (alac->outputsamples_buffer_a)
-        free(alac->outputsamples_buffer_a);
-    if (alac->outputsamples_buffer_b)
-        free(alac->outputsamples_buffer_b);
-
-    if (alac->uncompressed_bytes_buffer_a)
-        free(alac->uncompressed_bytes_buffer_a);
-    if (alac->uncompressed_bytes_buffer_b)
-        free(alac->uncompressed_bytes_buffer_b);
+    if (alac->arena)
+        free(alac->arena);
 
     free(alac);
 }
 
+/* all the per decoder scratch lives in one cache line aligned arena.
+ * the prediction runs in place, so the rice decoder writes straight
+ * into the output sample buffers and there are no separate error
+ * buffers. */
+#define ALAC_ARENA_ALIGN 64
+
 void alac_allocate_buffers(alac_file *alac)
 {
-    alac->predicterror_buffer_a = malloc(alac->setinfo_max_samples_per_frame * 4);
-    alac->predicterror_buffer_b = malloc(alac->setinfo_max_samples_per_frame * 4);
+    size_t size = (alac->setinfo_max_samples_per_frame * 4 + ALAC_ARENA_ALIGN - 1) &
+                  ~(size_t)(ALAC_ARENA_ALIGN - 1);
+    unsigned char *arena;
+
+    if (posix_memalign(&alac->arena, ALAC_ARENA_ALIGN, size * 4))
+    {
+        alac->arena = NULL;
+        return;
+    }
+    arena = alac->arena;
 
-    alac->outputsamples_buffer_a = malloc(alac->setinfo_max_samples_per_frame * 4);
-    alac->outputsamples_buffer_b = malloc(alac->setinfo_max_samples_per_frame * 4);
+    alac->outputsamples_buffer_a = (int32_t *)(arena);
+    alac->outputsamples_buffer_b = (int32_t *)(arena + size);
 
-    alac->uncompressed_bytes_buffer_a = malloc(alac->setinfo_max_samples_per_frame * 4);
-    alac->uncompressed_bytes_buffer_b = malloc(alac->setinfo_max_samples_per_frame * 4);
+    alac->uncompressed_bytes_buffer_a = (int32_t *)(arena + size * 2);
+    alac->uncompressed_bytes_buffer_b = (int32_t *)(arena + size * 3);
 }
 
 void alac_set_info(alac_file *alac, char *inputbuffer)
@@ -135,84 +157,74 @@ void alac_set_info(alac_file *alac, char *inputbuffer)
 
 /* stream reading */
 
-/* supports reading 1 to 16 bits, in big endian format */
-static uint32_t readbits_16(alac_file *alac, int bits)
+/* the bit reader keeps up to 64 bits of the stream in a cache,
+ * left aligned, so that most reads are a shift and a mask.
+ * it is refilled with one 32 bit big endian load whenever it drops
+ * to 32 bits or fewer, which is enough for any single read.
+ * near the end of the packet it falls back to a byte at a time,
+ * and reads past the end of the packet return zeros */
+static inline void refill_bitcache(alac_bitstream *stream)
 {
-    uint32_t result;
-    int new_accumulator;
-
-    result = (alac->input_buffer[0] << 16) |
-             (alac->input_buffer[1] << 8) |
-             (alac->input_buffer[2]);
-
-    /* shift left by the number of bits we've already read,
-     * so that the top 'n' bits of the 24 bits we read will
-     * be the return bits */
-    result = result << alac->input_buffer_bitaccumulator;
-
-    result = result & 0x00ffffff;
+    if (stream->bitcount > 32)
+        return;
 
-    /* and then only want the top 'n' bits from that, where
-     * n is 'bits' */
-    result = result >> (24 - bits);
+    if (stream->input_buffer_end - stream->input_buffer >= 4)
+    {
+        unsigned char *p = stream->input_buffer;
+        uint32_t word = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                        ((uint32_t)p[2] << 8) | p[3];
 
-    new_accumulator = (alac->input_buffer_bitaccumulator + bits);
+        stream->bitcache |= (uint64_t)word << (32 - stream->bitcount);
+        stream->bitcount += 32;
+        stream->input_buffer += 4;
+        return;
+    }
 
-    /* increase the buffer pointer if we've read over n bytes. */
-    alac->input_buffer += (new_accumulator >> 3);
+    while (stream->bitcount <= 56)
+    {
+        uint64_t byte = 0;
 
-    /* and the remainder goes back into the bit accumulator */
-    alac->input_buffer_bitaccumulator = (new_accumulator & 7);
+        if (stream->input_buffer < stream->input_buffer_end)
+            byte = *stream->input_buffer++;
 
-    return result;
+        stream->bitcache |= byte << (56 - stream->bitcount);
+        stream->bitcount += 8;
+    }
 }
 
-/* supports reading 1 to 32 bits, in big endian format */
-static uint32_t readbits(alac_file *alac, int bits)
+/* returns the next 'bits' bits without consuming them, 1 to 32 bits */
+static inline uint32_t peekbits(alac_bitstream *stream, int bits)
 {
-    int32_t result = 0;
-
-    if (bits > 16)
-    {
-        bits -= 16;
-        result = readbits_16(alac, 16) << bits;
-    }
+    refill_bitcache(stream);
 
-    result |= readbits_16(alac, bits);
-
-    return result;
+    return (uint32_t)(stream->bitcache >> (64 - bits));
 }
 
-/* reads a single bit */
-static int readbit(alac_file *alac)
+/* consumes 'bits' bits, 0 to 32 bits */
+static inline void skipbits(alac_bitstream *stream, int bits)
 {
-    int result;
-    int new_accumulator;
-
-    result = alac->input_buffer[0];
-
-    result = result << alac->input_buffer_bitaccumulator;
-
-    result = result >> 7 & 1;
+    stream->bitcache <<= bits;
+    stream->bitcount -= bits;
+}
 
-    new_accumulator = (alac->input_buffer_bitaccumulator + 1);
+/* supports reading 0 to 32 bits, in big endian format */
+static inline uint32_t readbits(alac_bitstream *stream, int bits)
+{
+    uint32_t result;
 
-    alac->input_buffer += (new_accumulator / 8);
+    if (bits == 0)
+        return 0;
 
-    alac->input_buffer_bitaccumulator = (new_accumulator % 8);
+    result = peekbits(stream, bits);
+    skipbits(stream, bits);
 
     return result;
 }
 
-static void unreadbits(alac_file *alac, int bits)
+/* reads a single bit */
+static inline int readbit(alac_bitstream *stream)
 {
-    int new_accumulator = (alac->input_buffer_bitaccumulator - bits);
-
-    alac->input_buffer += (new_accumulator >> 3);
-
-    alac->input_buffer_bitaccumulator = (new_accumulator & 7);
-    if (alac->input_buffer_bitaccumulator < 0)
-        alac->input_buffer_bitaccumulator *= -1;
+    return readbits(stream, 1);
 }
 
 /* various implementations of count_leading_zero:
@@ -308,25 +320,31 @@ found:
 
 #define RICE_THRESHOLD 8 // maximum number of bits for a rice prefix.
 
-static int32_t entropy_decode_value(alac_file* alac,
+static int32_t entropy_decode_value(alac_bitstream* stream,
                              int readSampleSize,
                              int k,
                              int rice_kmodifier_mask)
 {
-    int32_t x = 0; // decoded value
+    int32_t x; // decoded value
+    uint32_t window;
 
-    // read x, number of 1s before 0 represent the rice value.
-    while (x <= RICE_THRESHOLD && readbit(alac))
-    {
-        x++;
-    }
+    // look at the next 32 bits -- the prefix is at most 9 of them.
+    // the suffix, or the raw value after an escape, is read after it
+    window = peekbits(stream, 32);
+
+    // x, the number of 1s before the 0, is the rice prefix. count them
+    // all at once; the sentinel bit stops the count at RICE_THRESHOLD + 1
+    x = count_leading_zeros(~window | (1 << (31 - (RICE_THRESHOLD + 1))));
+
+    // the terminating 0 is only present when the prefix isn't an escape
+    skipbits(stream, x > RICE_THRESHOLD ? x : x + 1);
 
     if (x > RICE_THRESHOLD)
     {
         // read the number from the bit stream (raw value)
         int32_t value;
 
-        value = readbits(alac, readSampleSize);
+        value = readbits(stream, readSampleSize);
 
         // mask value
         value &= (((uint32_t)0xffffffff) >> (32 - readSampleSize));
@@ -337,22 +355,26 @@ static int32_t entropy_decode_value(alac_file* alac,
     {
         if (k != 1)
         {
-            int extraBits = readbits(alac, k);
+            int extraBits = peekbits(stream, k);
 
             // x = x * (2^k - 1)
             x *= (((1 << k) - 1) & rice_kmodifier_mask);
 
+            // a suffix of 0 or 1 is written in k-1 bits
             if (extraBits > 1)
+            {
                 x += extraBits - 1;
+                skipbits(stream, k);
+            }
             else
-                unreadbits(alac, 1);
+                skipbits(stream, k - 1);
         }
     }
 
     return x;
 }
 
-static void entropy_rice_decode(alac_file* alac,
+static void entropy_rice_decode(alac_bitstream* alac_stream,
                          int32_t* outputBuffer,
                          int outputSize,
                          int readSampleSize,
@@ -365,6 +387,9 @@ static void entropy_rice_decode(alac_file* alac,
     int             history = rice_initialhistory;
     int             signModifier = 0;
 
+    /* work on a local copy of the stream so that it can stay in registers */
+    alac_bitstream  stream = *alac_stream;
+
     for (outputCount = 0; outputCount < outputSize; outputCount++)
     {
         int32_t     decodedValue;
@@ -377,7 +402,7 @@ static void entropy_rice_decode(alac_file* alac,
         else k = rice_kmodifier;
 
         // note: don't use rice_kmodifier_mask here (set mask to 0xFFFFFFFF)
-        decodedValue = entropy_decode_value(alac, readSampleSize, k, 0xFFFFFFFF);
+        decodedValue = entropy_decode_value(&stream, readSampleSize, k, 0xFFFFFFFF);
 
         decodedValue += signModifier;
         finalValue = (decodedValue + 1) / 2; // inc by 1 and shift out sign bit
@@ -405,7 +430,7 @@ static void entropy_rice_decode(alac_file* alac,
             k = count_leading_zeros(history) + ((history + 16) / 64) - 24;
 
             // note: blockSize is always 16bit
-            blockSize = entropy_decode_value(alac, 16, k, rice_kmodifier_mask);
+            blockSize = entropy_decode_value(&stream, 16, k, rice_kmodifier_mask);
 
             // got blockSize 0s
             if (blockSize > 0)
@@ -420,6 +445,8 @@ static void entropy_rice_decode(alac_file* alac,
             history = 0;
         }
     }
+
+    *alac_stream = stream;
 }
 
 #define SIGN_EXTENDED32(val, bits) ((val << (32 - bits)) >> (32 - bits))
@@ -429,6 +456,242 @@ static void entropy_rice_decode(alac_file* alac,
                                 ((v > 0) ? (1) : \
                                            (0)))
 
+/* the adaptive fir filter.
+ *
+ * the coefficients are kept in reverse order (rc[i] is
+ * predictor_coef_table[order - 1 - i]), so that both the dot product and
+ * the coefficient update walk the history forwards: with b = buffer_out
+ * pointing at the oldest sample in the window,
+ *   sum = sum over i of (b[i + 1] - b[0]) * rc[i]
+ * and the update touches rc[0], rc[1], ... until the error changes sign.
+ *
+ * error_buffer and buffer_out may be the same buffer: every error is
+ * read before the sample in its place is written.
+ *
+ * the kernels below are instantiated for the orders encoders emit
+ * (4, 8 and 16) so that the compiler fully unrolls them, with a dot
+ * product that is either plain c or simd. sums wrap in 32 bits in every
+ * variant, so all of them are bit exact with each other.
+ */
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+#define FIR_MAX_ORDER 32
+
+static ALWAYS_INLINE int32_t fir_dot_c(const int32_t *b, const int16_t *rc, int order)
+{
+    int32_t b0 = b[0];
+    uint32_t sum = 0;
+    int i;
+
+    for (i = 0; i < order; i++)
+        sum += (uint32_t)(b[i + 1] - b0) * rc[i];
+
+    return sum;
+}
+
+/* predicts and stores one sample, then adapts the coefficients */
+static ALWAYS_INLINE void fir_step(int32_t *b, int16_t *rc, int order,
+                                   int32_t sum, int32_t error_val,
+                                   int readsamplesize, int quantization)
+{
+    int32_t b0 = b[0];
+    int32_t outval;
+    int error_sign, active;
+    int i;
+
+    outval = (1 << (quantization-1)) + sum;
+    outval = outval >> quantization;
+    outval = outval + b0 + error_val;
+    b[order + 1] = SIGN_EXTENDED32(outval, readsamplesize);
+
+    /* the coefficients move towards the sign of the error, one at a
+     * time, until the error has been used up. this is done without
+     * branches: a coefficient past the point where the error changed
+     * sign sees a zero mask. */
+    error_sign = (error_val > 0) - (error_val < 0);
+    active = -(error_val != 0);
+
+    for (i = 0; i < order; i++)
+    {
+        int val = b0 - b[i + 1];
+        int sign = SIGN_ONLY(val) * error_sign;
+
+        rc[i] -= sign & active;
+
+        val *= sign; /* absolute value, negated for a negative error */
+
+        error_val -= ((val >> quantization) * (i + 1)) & active;
+
+        active &= -(error_sign > 0 ? error_val > 0 : error_val < 0);
+    }
+}
+
+static ALWAYS_INLINE void fir_adapt_c(int32_t *error_buffer, int32_t *b,
+                                      int output_size, int readsamplesize,
+                                      int16_t *rc, int order,
+                                      int quantization)
+{
+    int i;
+
+    for (i = order + 1; i < output_size; i++, b++)
+        fir_step(b, rc, order, fir_dot_c(b, rc, order), error_buffer[i],
+                 readsamplesize, quantization);
+}
+
+static void fir_adapt_c_4(int32_t *e, int32_t *b, int n, int rss, int16_t *rc, int order, int q)
+{
+    fir_adapt_c(e, b, n, rss, rc, 4, q);
+}
+
+static void fir_adapt_c_8(int32_t *e, int32_t *b, int n, int rss, int16_t *rc, int order, int q)
+{
+    fir_adapt_c(e, b, n, rss, rc, 8, q);
+}
+
+static void fir_adapt_c_16(int32_t *e, int32_t *b, int n, int rss, int16_t *rc, int order, int q)
+{
+    fir_adapt_c(e, b, n, rss, rc, 16, q);
+}
+
+static void fir_adapt_c_n(int32_t *e, int32_t *b, int n, int rss, int16_t *rc, int order, int q)
+{
+    fir_adapt_c(e, b, n, rss, rc, order, q);
+}
+
+#ifdef ALAC_HAVE_SSE41
+__attribute__((target("sse4.1")))
+static ALWAYS_INLINE int32_t fir_dot_sse41(const int32_t *b, const int16_t *rc, int order)
+{
+    __m128i b0 = _mm_set1_epi32(b[0]);
+    __m128i acc = _mm_setzero_si128();
+    uint32_t sum;
+    int i;
+
+    for (i = 0; i + 4 <= order; i += 4)
+    {
+        __m128i d = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(b + i + 1)), b0);
+        __m128i c = _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *)(rc + i)));
+        acc = _mm_add_epi32(acc, _mm_mullo_epi32(d, c));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    sum = _mm_cvtsi128_si32(acc);
+
+    for (; i < order; i++)
+        sum += (uint32_t)(b[i + 1] - b[0]) * rc[i];
+
+    return sum;
+}
+
+__attribute__((target("sse4.1")))
+static ALWAYS_INLINE void fir_adapt_sse41(int32_t *error_buffer, int32_t *b,
+                                          int output_size, int readsamplesize,
+                                          int16_t *rc, int order,
+                                          int quantization)
+{
+    int i;
+
+    for (i = order + 1; i < output_size; i++, b++)
+        fir_step(b, rc, order, fir_dot_sse41(b, rc, order), error_buffer[i],
+                 readsamplesize, quantization);
+}
+
+__attribute__((target("sse4.1")))
+static void fir_adapt_sse41_16(int32_t *e, int32_t *b, int n, int rss, int16_t *rc, int order, int q)
+{
+    fir_adapt_sse41(e, b, n, rss, rc, 16, q);
+}
+#endif
+
+#ifdef ALAC_HAVE_NEON
+static ALWAYS_INLINE int32_t fir_dot_neon(const int32_t *b, const int16_t *rc, int order)
+{
+    int32x4_t b0 = vdupq_n_s32(b[0]);
+    int32x4_t acc = vdupq_n_s32(0);
+    int32x2_t half;
+    uint32_t sum;
+    int i;
+
+    for (i = 0; i + 4 <= order; i += 4)
+    {
+        int32x4_t d = vsubq_s32(vld1q_s32(b + i + 1), b0);
+        acc = vmlaq_s32(acc, d, vmovl_s16(vld1_s16(rc + i)));
+    }
+    half = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+    sum = vget_lane_s32(vpadd_s32(half, half), 0);
+
+    for (; i < order; i++)
+        sum += (uint32_t)(b[i + 1] - b[0]) * rc[i];
+
+    return sum;
+}
+
+static ALWAYS_INLINE void fir_adapt_neon(int32_t *error_buffer, int32_t *b,
+                                         int output_size, int readsamplesize,
+                                         int16_t *rc, int order,
+                                         int quantization)
+{
+    int i;
+
+    for (i = order + 1; i < output_size; i++, b++)
+        fir_step(b, rc, order, fir_dot_neon(b, rc, order), error_buffer[i],
+                 readsamplesize, quantization);
+}
+
+static void fir_adapt_neon_16(int32_t *e, int32_t *b, int n, int rss, int16_t *rc, int order, int q)
+{
+    fir_adapt_neon(e, b, n, rss, rc, 16, q);
+}
+#endif
+
+typedef void (*fir_adapt_kernel)(int32_t *error_buffer, int32_t *buffer_out,
+                                 int output_size, int readsamplesize,
+                                 int16_t *rc, int order, int quantization);
+
+/* kernels for order 4, 8, 16 and any other order.
+ * every output sample feeds the next dot product, so the filter is
+ * bound by latency, and for short filters the horizontal add of a simd
+ * dot product costs more than it saves. only order 16 uses simd.
+ */
+static fir_adapt_kernel fir_kernels[4] = {
+    fir_adapt_c_4,
+    fir_adapt_c_8,
+#if defined(ALAC_HAVE_NEON)
+    fir_adapt_neon_16,
+#else
+    fir_adapt_c_16,
+#endif
+    fir_adapt_c_n
+};
+
+/* picks the best kernels for this cpu, called from alac_create */
+static void fir_select_kernels(void)
+{
+#ifdef ALAC_HAVE_SSE41
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1"))
+        fir_kernels[2] = fir_adapt_sse41_16;
+#endif
+}
+
+const char *alac_implementation(void)
+{
+    fir_select_kernels();
+#if defined(ALAC_HAVE_NEON)
+    return "NEON";
+#else
+#ifdef ALAC_HAVE_SSE41
+    if (fir_kernels[2] == fir_adapt_sse41_16)
+        return "SSE4.1";
+#endif
+    return "C";
+#endif
+}
+
 static void predictor_decompress_fir_adapt(int32_t *error_buffer,
                                            int32_t *buffer_out,
                                            int output_size,
@@ -438,13 +701,15 @@ static void predictor_decompress_fir_adapt(int32_t *error_buffer,
                                            int predictor_quantitization)
 {
     int i;
+    int16_t rc[FIR_MAX_ORDER];
+    fir_adapt_kernel kernel;
 
     /* first sample always copies */
     *buffer_out = *error_buffer;
 
     if (!predictor_coef_num)
     {
-        if (output_size <= 1) return;
+        if (output_size <= 1 || buffer_out == error_buffer) return;
         memcpy(buffer_out+1, error_buffer+1, (output_size-1) * 4);
         return;
     }
@@ -482,92 +747,126 @@ static void predictor_decompress_fir_adapt(int32_t *error_buffer,
         }
     }
 
-#if 0
-    /* 4 and 8 are very common cases (the only ones i've seen). these
-     * should be unrolled and optimised
-     */
-    if (predictor_coef_num == 4)
-    {
-        /* FIXME: optimised general case */
-        return;
-    }
-
-    if (predictor_coef_table == 8)
-    {
-        /* FIXME: optimised general case */
-        return;
-    }
-#endif
-
-
     /* general case */
     if (predictor_coef_num > 0)
     {
-        for (i = predictor_coef_num + 1;
-             i < output_size;
-             i++)
+        switch (predictor_coef_num)
         {
-            int j;
-            int sum = 0;
-            int outval;
-            int error_val = error_buffer[i];
+        case 4: kernel = fir_kernels[0]; break;
+        case 8: kernel = fir_kernels[1]; break;
+        case 16: kernel = fir_kernels[2]; break;
+        default: kernel = fir_kernels[3]; break;
+        }
 
-            for (j = 0; j < predictor_coef_num; j++)
-            {
-                sum += (buffer_out[predictor_coef_num-j] - buffer_out[0]) *
-                       predictor_coef_table[j];
-            }
+        for (i = 0; i < predictor_coef_num; i++)
+            rc[i] = predictor_coef_table[predictor_coef_num - 1 - i];
 
-            outval = (1 << (predictor_quantitization-1)) + sum;
-            outval = outval >> predictor_quantitization;
-            outval = outval + buffer_out[0] + error_val;
-            outval = SIGN_EXTENDED32(outval, readsamplesize);
+        kernel(error_buffer, buffer_out, output_size, readsamplesize,
+               rc, predictor_coef_num, predictor_quantitization);
 
-            buffer_out[predictor_coef_num+1] = outval;
+        for (i = 0; i < predictor_coef_num; i++)
+            predictor_coef_table[predictor_coef_num - 1 - i] = rc[i];
+    }
+}
 
-            if (error_val > 0)
-            {
-                int predictor_num = predictor_coef_num - 1;
+/* the simd deinterlacers handle stereo only and return the number of
+ * samples they did, the rest is left to the plain c loops. the samples
+ * are truncated to 16 bits, the same as the c casts. */
+#if defined(ALAC_HAVE_SSE2)
+static inline __m128i mullo_epi32_sse2(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
 
-                while (predictor_num >= 0 && error_val > 0)
-                {
-                    int val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
-                    int sign = SIGN_ONLY(val);
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static inline __m128i pack_truncate_epi32_sse2(__m128i a, __m128i b)
+{
+    a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+    b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
 
-                    predictor_coef_table[predictor_num] -= sign;
+    return _mm_packs_epi32(a, b);
+}
 
-                    val *= sign; /* absolute value */
+static int deinterlace_16_simd(int32_t *buffer_a, int32_t *buffer_b,
+                               int16_t *buffer_out, int numsamples,
+                               uint8_t interlacing_shift,
+                               uint8_t interlacing_leftweight)
+{
+    __m128i weight = _mm_set1_epi32(interlacing_leftweight);
+    __m128i shift = _mm_cvtsi32_si128(interlacing_shift);
+    int i;
 
-                    error_val -= ((val >> predictor_quantitization) *
-                                  (predictor_coef_num - predictor_num));
+    for (i = 0; i + 8 <= numsamples; i += 8)
+    {
+        __m128i left0, left1, right0, right1, left, right;
 
-                    predictor_num--;
-                }
-            }
-            else if (error_val < 0)
-            {
-                int predictor_num = predictor_coef_num - 1;
+        left0 = _mm_loadu_si128((__m128i *)(buffer_a + i));
+        left1 = _mm_loadu_si128((__m128i *)(buffer_a + i + 4));
+        right0 = _mm_loadu_si128((__m128i *)(buffer_b + i));
+        right1 = _mm_loadu_si128((__m128i *)(buffer_b + i + 4));
 
-                while (predictor_num >= 0 && error_val < 0)
-                {
-                    int val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
-                    int sign = - SIGN_ONLY(val);
+        if (interlacing_leftweight)
+        {
+            /* buffer_a holds midright, buffer_b the difference */
+            __m128i diff0 = right0, diff1 = right1;
 
-                    predictor_coef_table[predictor_num] -= sign;
+            right0 = _mm_sub_epi32(left0, _mm_sra_epi32(mullo_epi32_sse2(diff0, weight), shift));
+            right1 = _mm_sub_epi32(left1, _mm_sra_epi32(mullo_epi32_sse2(diff1, weight), shift));
+            left0 = _mm_add_epi32(right0, diff0);
+            left1 = _mm_add_epi32(right1, diff1);
+        }
 
-                    val *= sign; /* neg value */
+        left = pack_truncate_epi32_sse2(left0, left1);
+        right = pack_truncate_epi32_sse2(right0, right1);
 
-                    error_val -= ((val >> predictor_quantitization) *
-                                  (predictor_coef_num - predictor_num));
+        _mm_storeu_si128((__m128i *)(buffer_out + i * 2), _mm_unpacklo_epi16(left, right));
+        _mm_storeu_si128((__m128i *)(buffer_out + i * 2 + 8), _mm_unpackhi_epi16(left, right));
+    }
 
-                    predictor_num--;
-                }
-            }
+    return i;
+}
+#elif defined(ALAC_HAVE_NEON)
+static int deinterlace_16_simd(int32_t *buffer_a, int32_t *buffer_b,
+                               int16_t *buffer_out, int numsamples,
+                               uint8_t interlacing_shift,
+                               uint8_t interlacing_leftweight)
+{
+    int32x4_t weight = vdupq_n_s32(interlacing_leftweight);
+    int32x4_t shift = vdupq_n_s32(-(int)interlacing_shift);
+    int i;
+
+    for (i = 0; i + 8 <= numsamples; i += 8)
+    {
+        int32x4_t left0, left1, right0, right1;
+        int16x8x2_t out;
+
+        left0 = vld1q_s32(buffer_a + i);
+        left1 = vld1q_s32(buffer_a + i + 4);
+        right0 = vld1q_s32(buffer_b + i);
+        right1 = vld1q_s32(buffer_b + i + 4);
 
-            buffer_out++;
+        if (interlacing_leftweight)
+        {
+            /* buffer_a holds midright, buffer_b the difference */
+            int32x4_t diff0 = right0, diff1 = right1;
+
+            right0 = vsubq_s32(left0, vshlq_s32(vmulq_s32(diff0, weight), shift));
+            right1 = vsubq_s32(left1, vshlq_s32(vmulq_s32(diff1, weight), shift));
+            left0 = vaddq_s32(right0, diff0);
+            left1 = vaddq_s32(right1, diff1);
         }
+
+        out.val[0] = vcombine_s16(vmovn_s32(left0), vmovn_s32(left1));
+        out.val[1] = vcombine_s16(vmovn_s32(right0), vmovn_s32(right1));
+        vst2q_s16(buffer_out + i * 2, out);
     }
+
+    return i;
 }
+#endif
 
 static void deinterlace_16(int32_t *buffer_a, int32_t *buffer_b,
                     int16_t *buffer_out,
@@ -575,13 +874,19 @@ static void deinterlace_16(int32_t *buffer_a, int32_t *buffer_b,
                     uint8_t interlacing_shift,
                     uint8_t interlacing_leftweight)
 {
-    int i;
+    int i = 0;
     if (numsamples <= 0) return;
 
+#if defined(ALAC_HAVE_SSE2) || defined(ALAC_HAVE_NEON)
+    if (numchannels == 2 && !host_bigendian)
+        i = deinterlace_16_simd(buffer_a, buffer_b, buffer_out, numsamples,
+                                interlacing_shift, interlacing_leftweight);
+#endif
+
     /* weighted interlacing */
     if (interlacing_leftweight)
     {
-        for (i = 0; i < numsamples; i++)
+        for (; i < numsamples; i++)
         {
             int32_t difference, midright;
             int16_t left;
@@ -609,7 +914,7 @@ static void deinterlace_16(int32_t *buffer_a, int32_t *buffer_b,
     }
 
     /* otherwise basic interlacing took place */
-    for (i = 0; i < numsamples; i++)
+    for (; i < numsamples; i++)
     {
         int16_t left, right;
 
@@ -707,17 +1012,19 @@ static void deinterlace_24(int32_t *buffer_a, int32_t *buffer_b,
 }
 
 void alac_decode_frame(alac_file *alac,
-                       unsigned char *inbuffer,
+                       unsigned char *inbuffer, int inputsize,
                        void *outbuffer, int *outputsize)
 {
     int channels;
     int32_t outputsamples = alac->setinfo_max_samples_per_frame;
 
     /* setup the stream */
-    alac->input_buffer = inbuffer;
-    alac->input_buffer_bitaccumulator = 0;
+    alac->stream.input_buffer = inbuffer;
+    alac->stream.input_buffer_end = inbuffer + inputsize;
+    alac->stream.bitcache = 0;
+    alac->stream.bitcount = 0;
 
-    channels = readbits(alac, 3);
+    channels = readbits(&alac->stream, 3);
 
     *outputsize = outputsamples * alac->bytespersample;
 
@@ -735,21 +1042,21 @@ void alac_decode_frame(alac_file *alac,
         /* 2^result = something to do with output waiting.
          * perhaps matters if we read > 1 frame in a pass?
          */
-        readbits(alac, 4);
+        readbits(&alac->stream, 4);
 
-        readbits(alac, 12); /* unknown, skip 12 bits */
+        readbits(&alac->stream, 12); /* unknown, skip 12 bits */
 
-        hassize = readbits(alac, 1); /* the output sample size is stored soon */
+        hassize = readbits(&alac->stream, 1); /* the output sample size is stored soon */
 
-        uncompressed_bytes = readbits(alac, 2); /* number of bytes in the (compressed) stream that are not compressed */
+        uncompressed_bytes = readbits(&alac->stream, 2); /* number of bytes in the (compressed) stream that are not compressed */
 
-        isnotcompressed = readbits(alac, 1); /* whether the frame is compressed */
+        isnotcompressed = readbits(&alac->stream, 1); /* whether the frame is compressed */
 
         if (hassize)
         {
             /* now read the number of samples,
              * as a 32bit integer */
-            outputsamples = readbits(alac, 32);
+            outputsamples = readbits(&alac->stream, 32);
             *outputsize = outputsamples * alac->bytespersample;
         }
 
@@ -765,19 +1072,19 @@ void alac_decode_frame(alac_file *alac,
 
             /* skip 16 bits, not sure what they are. seem to be used in
              * two channel case */
-            readbits(alac, 8);
-            readbits(alac, 8);
+            readbits(&alac->stream, 8);
+            readbits(&alac->stream, 8);
 
-            prediction_type = readbits(alac, 4);
-            prediction_quantitization = readbits(alac, 4);
+            prediction_type = readbits(&alac->stream, 4);
+            prediction_quantitization = readbits(&alac->stream, 4);
 
-            ricemodifier = readbits(alac, 3);
-            predictor_coef_num = readbits(alac, 5);
+            ricemodifier = readbits(&alac->stream, 3);
+            predictor_coef_num = readbits(&alac->stream, 5);
 
             /* read the predictor table */
             for (i = 0; i < predictor_coef_num; i++)
             {
-                predictor_coef_table[i] = (int16_t)readbits(alac, 16);
+                predictor_coef_table[i] = (int16_t)readbits(&alac->stream, 16);
             }
 
             if (uncompressed_bytes)
@@ -785,12 +1092,12 @@ void alac_decode_frame(alac_file *alac,
                 int i;
                 for (i = 0; i < outputsamples; i++)
                 {
-                    alac->uncompressed_bytes_buffer_a[i] = readbits(alac, uncompressed_bytes * 8);
+                    alac->uncompressed_bytes_buffer_a[i] = readbits(&alac->stream, uncompressed_bytes * 8);
                 }
             }
 
-            entropy_rice_decode(alac,
-                                alac->predicterror_buffer_a,
+            entropy_rice_decode(&alac->stream,
+                                alac->outputsamples_buffer_a,
                                 outputsamples,
                                 readsamplesize,
                                 alac->setinfo_rice_initialhistory,
@@ -800,7 +1107,7 @@ void alac_decode_frame(alac_file *alac,
 
             if (prediction_type == 0)
             { /* adaptive fir */
-                predictor_decompress_fir_adapt(alac->predicterror_buffer_a,
+                predictor_decompress_fir_adapt(alac->outputsamples_buffer_a,
                                                alac->outputsamples_buffer_a,
                                                outputsamples,
                                                readsamplesize,
@@ -827,7 +1134,7 @@ void alac_decode_frame(alac_file *alac,
                 int i;
                 for (i = 0; i < outputsamples; i++)
                 {
-                    int32_t audiobits = readbits(alac, alac->setinfo_sample_size);
+                    int32_t audiobits = readbits(&alac->stream, alac->setinfo_sample_size);
 
                     audiobits = SIGN_EXTENDED32(audiobits, alac->setinfo_sample_size);
 
@@ -841,11 +1148,11 @@ void alac_decode_frame(alac_file *alac,
                 {
                     int32_t audiobits;
 
-                    audiobits = readbits(alac, 16);
+                    audiobits = readbits(&alac->stream, 16);
                     /* special case of sign extension..
                      * as we'll be ORing the low 16bits into this */
                     audiobits = audiobits << (alac->setinfo_sample_size - 16);
-                    audiobits |= readbits(alac, alac->setinfo_sample_size - 16);
+                    audiobits |= readbits(&alac->stream, alac->setinfo_sample_size - 16);
                     audiobits = SignExtend24(audiobits);
 
                     alac->outputsamples_buffer_a[i] = audiobits;
@@ -912,21 +1219,21 @@ void alac_decode_frame(alac_file *alac,
         /* 2^result = something to do with output waiting.
          * perhaps matters if we read > 1 frame in a pass?
          */
-        readbits(alac, 4);
+        readbits(&alac->stream, 4);
 
-        readbits(alac, 12); /* unknown, skip 12 bits */
+        readbits(&alac->stream, 12); /* unknown, skip 12 bits */
 
-        hassize = readbits(alac, 1); /* the output sample size is stored soon */
+        hassize = readbits(&alac->stream, 1); /* the output sample size is stored soon */
 
-        uncompressed_bytes = readbits(alac, 2); /* the number of bytes in the (compressed) stream that are not compressed */
+        uncompressed_bytes = readbits(&alac->stream, 2); /* the number of bytes in the (compressed) stream that are not compressed */
 
-        isnotcompressed = readbits(alac, 1); /* whether the frame is compressed */
+        isnotcompressed = readbits(&alac->stream, 1); /* whether the frame is compressed */
 
         if (hassize)
         {
             /* now read the number of samples,
              * as a 32bit integer */
-            outputsamples = readbits(alac, 32);
+            outputsamples = readbits(&alac->stream, 32);
             *outputsize = outputsamples * alac->bytespersample;
         }
 
@@ -948,33 +1255,33 @@ void alac_decode_frame(alac_file *alac,
 
             int i;
 
-            interlacing_shift = readbits(alac, 8);
-            interlacing_leftweight = readbits(alac, 8);
+            interlacing_shift = readbits(&alac->stream, 8);
+            interlacing_leftweight = readbits(&alac->stream, 8);
 
             /******** channel 1 ***********/
-            prediction_type_a = readbits(alac, 4);
-            prediction_quantitization_a = readbits(alac, 4);
+            prediction_type_a = readbits(&alac->stream, 4);
+            prediction_quantitization_a = readbits(&alac->stream, 4);
 
-            ricemodifier_a = readbits(alac, 3);
-            predictor_coef_num_a = readbits(alac, 5);
+            ricemodifier_a = readbits(&alac->stream, 3);
+            predictor_coef_num_a = readbits(&alac->stream, 5);
 
             /* read the predictor table */
             for (i = 0; i < predictor_coef_num_a; i++)
             {
-                predictor_coef_table_a[i] = (int16_t)readbits(alac, 16);
+                predictor_coef_table_a[i] = (int16_t)readbits(&alac->stream, 16);
             }
 
             /******** channel 2 *********/
-            prediction_type_b = readbits(alac, 4);
-            prediction_quantitization_b = readbits(alac, 4);
+            prediction_type_b = readbits(&alac->stream, 4);
+            prediction_quantitization_b = readbits(&alac->stream, 4);
 
-            ricemodifier_b = readbits(alac, 3);
-            predictor_coef_num_b = readbits(alac, 5);
+            ricemodifier_b = readbits(&alac->stream, 3);
+            predictor_coef_num_b = readbits(&alac->stream, 5);
 
             /* read the predictor table */
             for (i = 0; i < predictor_coef_num_b; i++)
             {
-                predictor_coef_table_b[i] = (int16_t)readbits(alac, 16);
+                predictor_coef_table_b[i] = (int16_t)readbits(&alac->stream, 16);
             }
 
             /*********************/
@@ -983,14 +1290,14 @@ void alac_decode_frame(alac_file *alac,
                 int i;
                 for (i = 0; i < outputsamples; i++)
                 {
-                    alac->uncompressed_bytes_buffer_a[i] = readbits(alac, uncompressed_bytes * 8);
-                    alac->uncompressed_bytes_buffer_b[i] = readbits(alac, uncompressed_bytes * 8);
+                    alac->uncompressed_bytes_buffer_a[i] = readbits(&alac->stream, uncompressed_bytes * 8);
+                    alac->uncompressed_bytes_buffer_b[i] = readbits(&alac->stream, uncompressed_bytes * 8);
                 }
             }
 
             /* channel 1 */
-            entropy_rice_decode(alac,
-                                alac->predicterror_buffer_a,
+            entropy_rice_decode(&alac->stream,
+                                alac->outputsamples_buffer_a,
                                 outputsamples,
                                 readsamplesize,
                                 alac->setinfo_rice_initialhistory,
@@ -1000,7 +1307,7 @@ void alac_decode_frame(alac_file *alac,
 
             if (prediction_type_a == 0)
             { /* adaptive fir */
-                predictor_decompress_fir_adapt(alac->predicterror_buffer_a,
+                predictor_decompress_fir_adapt(alac->outputsamples_buffer_a,
                                                alac->outputsamples_buffer_a,
                                                outputsamples,
                                                readsamplesize,
@@ -1014,8 +1321,8 @@ void alac_decode_frame(alac_file *alac,
             }
 
             /* channel 2 */
-            entropy_rice_decode(alac,
-                                alac->predicterror_buffer_b,
+            entropy_rice_decode(&alac->stream,
+                                alac->outputsamples_buffer_b,
                                 outputsamples,
                                 readsamplesize,
                                 alac->setinfo_rice_initialhistory,
@@ -1025,7 +1332,7 @@ void alac_decode_frame(alac_file *alac,
 
             if (prediction_type_b == 0)
             { /* adaptive fir */
-                predictor_decompress_fir_adapt(alac->predicterror_buffer_b,
+                predictor_decompress_fir_adapt(alac->outputsamples_buffer_b,
                                                alac->outputsamples_buffer_b,
                                                outputsamples,
                                                readsamplesize,
@@ -1047,8 +1354,8 @@ void alac_decode_frame(alac_file *alac,
                 {
                     int32_t audiobits_a, audiobits_b;
 
-                    audiobits_a = readbits(alac, alac->setinfo_sample_size);
-                    audiobits_b = readbits(alac, alac->setinfo_sample_size);
+                    audiobits_a = readbits(&alac->stream, alac->setinfo_sample_size);
+                    audiobits_b = readbits(&alac->stream, alac->setinfo_sample_size);
 
                     audiobits_a = SIGN_EXTENDED32(audiobits_a, alac->setinfo_sample_size);
                     audiobits_b = SIGN_EXTENDED32(audiobits_b, alac->setinfo_sample_size);
@@ -1064,14 +1371,14 @@ void alac_decode_frame(alac_file *alac,
                 {
                     int32_t audiobits_a, audiobits_b;
 
-                    audiobits_a = readbits(alac, 16);
+                    audiobits_a = readbits(&alac->stream, 16);
                     audiobits_a = audiobits_a << (alac->setinfo_sample_size - 16);
-                    audiobits_a |= readbits(alac, alac->setinfo_sample_size - 16);
+                    audiobits_a |= readbits(&alac->stream, alac->setinfo_sample_size - 16);
                     audiobits_a = SignExtend24(audiobits_a);
 
-                    audiobits_b = readbits(alac, 16);
+                    audiobits_b = readbits(&alac->stream, 16);
                     audiobits_b = audiobits_b << (alac->setinfo_sample_size - 16);
-                    audiobits_b |= readbits(alac, alac->setinfo_sample_size - 16);
+                    audiobits_b |= readbits(&alac->stream, alac->setinfo_sample_size - 16);
                     audiobits_b = SignExtend24(audiobits_b);
 
                     alac->outputsamples_buffer_a[i] = audiobits_a;
@@ -1133,6 +1440,8 @@ alac_file *alac_create(int samplesize, int numchannels)
     newfile->numchannels = numchannels;
     newfile->bytespersample = (samplesize / 8) * numchannels;
 
+    fir_select_kernels();
+
     return newfile;
 }
 
@@ -4,29 +4,38 @@
 #include <stdint.h>
 
 typedef struct alac_file alac_file;
+typedef struct alac_bitstream alac_bitstream;
 
 alac_file *alac_create(int samplesize, int numchannels);
 void alac_decode_frame(alac_file *alac,
-                       unsigned char *inbuffer,
+                       unsigned char *inbuffer, int inputsize,
                        void *outbuffer, int *outputsize);
 void alac_set_info(alac_file *alac, char *inputbuffer);
 void alac_allocate_buffers(alac_file *alac);
 void alac_free(alac_file *alac);
 
-struct alac_file
+/* the name of the implementation of the filter kernels in use */
+const char *alac_implementation(void);
+
+struct alac_bitstream
 {
     unsigned char *input_buffer;
-    int input_buffer_bitaccumulator; /* used so we can do arbitary
-                                        bit reads */
+    unsigned char *input_buffer_end;
+    uint64_t bitcache; /* the next bits of the stream, left aligned */
+    int bitcount; /* number of valid bits in the cache */
+};
+
+struct alac_file
+{
+    alac_bitstream stream;
 
     int samplesize;
     int numchannels;
     int bytespersample;
 
 
-    /* buffers */
-    int32_t *predicterror_buffer_a;
-    int32_t *predicterror_buffer_b;
+    /* buffers, carved out of one arena */
+    void *arena;
 
     int32_t *outputsamples_buffer_a;
     int32_t *outputsamples_buffer_b;
@@ -16,6 +16,18 @@ typedef struct {
     
     // block of samples
     void (*play)(short buf[], int samples);
+
+    // may be null: write straight into the device's buffer instead of passing a buffer to play().
+    // begin_write returns 0 and sets *buf if there is room for frames frames there, all in one piece;
+    // otherwise it returns nonzero, and play() should be used instead.
+    // After a successful begin_write, commit must be called, with the number of frames actually written.
+    int (*begin_write)(short **buf, int frames);
+    void (*commit)(int frames);
+
+    // may be null: rather than start playing as soon as frames are sent, start at the given time
+    // (as from get_absolute_time_in_fp()), so that the frames sent in the meantime are queued up ready.
+    // Returns 0 if it can, in which case delay() counts the wait as well. A flush cancels it.
+    int (*start_at)(uint64_t time_of_start);
     void (*stop)(void);
     
     // may be null if not implemented
@@ -26,11 +38,17 @@ typedef struct {
     // will change dynamically, so keep watching it. Implemented in ALSA only.
     uint32_t (*delay)();
 
+    // may be null: like delay(), but the delay as it is at the given time (as from get_absolute_time_in_fp()),
+    // which should be about now. Lets the player tie the delay to its own reading of the clock.
+    uint32_t (*delay_at)(uint64_t time);
+
     // may be NULL, in which case soft volume is applied
     void (*volume)(double vol);
 } audio_output;
 
 audio_output *audio_get_output(char *name);
+// wrap an output so that frames are passed to it by a thread of its own, through a ring buffer -- see audio_buffered.c
+audio_output *audio_buffered(audio_output *output);
 void audio_ls_outputs(void);
 
 #endif //_AUDIO_H
@@ -27,6 +27,8 @@
 #define ALSA_PCM_NEW_HW_PARAMS_API
 
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
 #include <memory.h>
 #include <pthread.h>
@@ -39,10 +41,17 @@ static int init(int argc, char **argv);
 static void deinit(void);
 static void start(int sample_rate);
 static void play(short buf[], int samples);
+static int begin_write(short **buf, int frames);
+static void commit(int frames);
+static int start_at(uint64_t time_of_start);
 static void stop(void);
 static void flush(void);
 static uint32_t delay(void);
+static uint32_t delay_at(uint64_t time);
 static void volume(double vol);
+static void close_alsa_device(void);
+static void *release_thread_func(void *arg);
+static void *start_thread_func(void *arg);
 static int has_mute=0;
 static int has_db_vol=0;
 static double set_volume;
@@ -56,7 +65,11 @@ audio_output audio_alsa = {
     .stop = &stop,
     .flush = &flush,
     .delay = &delay,
+    .delay_at = &delay_at,
     .play = &play,
+    .begin_write = &begin_write,
+    .commit = &commit,
+    .start_at = &start_at,
     .volume = NULL
 };
 
@@ -66,6 +79,8 @@ static unsigned int desired_sample_rate;
 
 static snd_pcm_t *alsa_handle = NULL;
 static snd_pcm_hw_params_t *alsa_params = NULL;
+static int mmap_access; // if the device's buffer is written directly
+static snd_pcm_uframes_t mmap_offset; // where begin_write's frames are in it
 
 static snd_mixer_t *alsa_mix_handle = NULL;
 static snd_mixer_elem_t *alsa_mix_elem = NULL;
@@ -78,6 +93,26 @@ static char *alsa_mix_dev = NULL;
 static char *alsa_mix_ctrl = "Master";
 static int alsa_mix_index = 0;
 
+static int keep_open = 0; // if set, flush and stop only drop frames -- the device stays open for the next time
+static int idle_release_time = 0; // if keeping it open, close it after this many seconds of silence; 0 means never
+static uint64_t time_of_last_use; // when frames were last written to the device
+static pthread_t release_thread;
+static pthread_cond_t release_cond;
+
+static uint64_t time_of_start; // if nonzero, when the device is to be started -- see start_at()
+static pthread_t start_thread;
+static pthread_cond_t start_cond;
+
+static int threads_stop; // tells the threads above to finish
+
+// The delay is read from the device now and again, along with the time it was so, and worked out in between
+// from the frames written since and the time gone by -- which saves a system call or two for every packet.
+#define DELAY_MEASUREMENT_INTERVAL (((uint64_t)1<<32)/10) // 0.1 seconds
+static int hw_timestamps; // if the device time stamps its status on the clock of get_absolute_time_in_fp()
+static snd_pcm_sframes_t measured_delay;
+static uint64_t time_of_measurement; // zero if there is no measurement to go on
+static snd_pcm_sframes_t frames_written_since; // frames written since the measurement
+
 static int play_number;
 static int64_t accumulated_delay,accumulated_da_delay;
 
@@ -87,6 +122,8 @@ static void help(void) {
            "    -m mixer-device     set the mixer device ['output-device'*|...]\n"
            "    -c mixer-control    set the mixer control [Master*|...]\n"
            "    -i mixer-index      set the mixer index [0*|...]\n"
+           "    -k seconds          keep the output device open across flushes and sessions,\n"
+           "                        closing it after this many seconds of silence [0: never]\n"
            "    *) default option\n"
           );
 }
@@ -99,7 +136,7 @@ static int init(int argc, char **argv) {
   argc++;
   // some platforms apparently require optreset = 1; - which?
   int opt;
-  while ((opt = getopt(argc, argv, "d:t:m:c:i:")) > 0) {
+  while ((opt = getopt(argc, argv, "d:t:m:c:i:k:")) > 0) {
       switch (opt) {
           case 'd':
               alsa_out_dev = optarg;
@@ -117,6 +154,10 @@ static int init(int argc, char **argv) {
           case 'i':
               alsa_mix_index = strtol(optarg, NULL, 10);
               break;
+          case 'k':
+              keep_open = 1;
+              idle_release_time = strtol(optarg, NULL, 10);
+              break;
           default:
               help();
               die("Invalid audio option -%c specified", opt);
@@ -126,6 +167,22 @@ static int init(int argc, char **argv) {
   if (optind < argc)
       die("Invalid audio argument: %s", argv[optind]);
 
+  if (keep_open) {
+    if (idle_release_time>0)
+      debug(2,"ALSA output device will be kept open, and closed after %d seconds of silence.",idle_release_time);
+    else
+      debug(2,"ALSA output device will be kept open.");
+  }
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // the clock of get_absolute_time_in_fp()
+  if (idle_release_time>0) {
+    pthread_cond_init(&release_cond,&attr);
+    pthread_create(&release_thread, NULL, release_thread_func, NULL);
+  }
+  pthread_cond_init(&start_cond,&attr);
+  pthread_create(&start_thread, NULL, start_thread_func, NULL);
+
   if (!hardware_mixer)
       return 0;
 
@@ -176,14 +233,28 @@ static int init(int argc, char **argv) {
 }
 
 static void deinit(void) {
+  pthread_mutex_lock(&alsa_mutex);
+  threads_stop = 1;
+  if (idle_release_time>0)
+    pthread_cond_signal(&release_cond);
+  pthread_cond_signal(&start_cond);
+  pthread_mutex_unlock(&alsa_mutex);
+  if (idle_release_time>0)
+    pthread_join(release_thread, NULL);
+  pthread_join(start_thread, NULL);
   stop();
+  pthread_mutex_lock(&alsa_mutex);
+  close_alsa_device();
+  pthread_mutex_unlock(&alsa_mutex);
   if (alsa_mix_handle) {
       snd_mixer_close(alsa_mix_handle);
   }
 }
 
+// alsa_mutex must be held by the caller of these two
 int open_alsa_device(void) { 
 
+  uint64_t time_of_open = get_absolute_time_in_fp();
   int ret, dir = 0;
   unsigned int my_sample_rate = desired_sample_rate;
   snd_pcm_uframes_t frames = 441*10;
@@ -195,7 +266,11 @@ int open_alsa_device(void) {
 
   snd_pcm_hw_params_alloca(&alsa_params);
   snd_pcm_hw_params_any(alsa_handle, alsa_params);
-  snd_pcm_hw_params_set_access(alsa_handle, alsa_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+  // write directly into the device's buffer if it can be mapped, so that the player can put its output straight there
+  mmap_access = (snd_pcm_hw_params_set_access(alsa_handle, alsa_params, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0);
+  if (!mmap_access)
+    snd_pcm_hw_params_set_access(alsa_handle, alsa_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+  debug(2,"ALSA output device %s %s mapped.",alsa_out_dev,mmap_access ? "is" : "is not");
   snd_pcm_hw_params_set_format(alsa_handle, alsa_params, SND_PCM_FORMAT_S16);
   snd_pcm_hw_params_set_channels(alsa_handle, alsa_params, 2);
   snd_pcm_hw_params_set_rate_near(alsa_handle, alsa_params, &my_sample_rate, &dir);
@@ -208,32 +283,210 @@ int open_alsa_device(void) {
   if (my_sample_rate!=desired_sample_rate) {
     die("Can't set the D/A converter to %d -- set to %d instead./n",desired_sample_rate,my_sample_rate);
   }
+  // the device is always started explicitly, so that it can be started at a set time -- see start_if_due()
+  snd_pcm_sw_params_t *alsa_swparams;
+  snd_pcm_uframes_t boundary;
+  snd_pcm_sw_params_alloca(&alsa_swparams);
+  snd_pcm_sw_params_current(alsa_handle, alsa_swparams);
+  snd_pcm_sw_params_get_boundary(alsa_swparams, &boundary);
+  snd_pcm_sw_params_set_start_threshold(alsa_handle, alsa_swparams, boundary);
+  hw_timestamps = 0;
+#ifdef HAVE_ALSA_TSTAMP_TYPE
+  // have the status time stamped with the time the device's position was last updated, on the monotonic clock
+  if ((snd_pcm_sw_params_set_tstamp_mode(alsa_handle, alsa_swparams, SND_PCM_TSTAMP_ENABLE)==0) &&
+      (snd_pcm_sw_params_set_tstamp_type(alsa_handle, alsa_swparams, SND_PCM_TSTAMP_TYPE_MONOTONIC)==0))
+    hw_timestamps = 1;
+#endif
+  ret = snd_pcm_sw_params(alsa_handle, alsa_swparams);
+  if (ret < 0) {
+    die("unable to set sw parameters: %s.", snd_strerror(ret));
+  }
+  uint64_t time_taken = get_absolute_time_in_fp()-time_of_open;
+  debug(2,"ALSA output device %s opened in %.3f ms.",alsa_out_dev,(time_taken*1000.0)/((uint64_t)1<<32));
+  time_of_last_use = get_absolute_time_in_fp();
+  time_of_measurement = 0;
   return(0);
 }
 
+static void close_alsa_device(void) {
+  time_of_measurement = 0;
+  if (alsa_handle) {
+    snd_pcm_close(alsa_handle);
+    alsa_handle = NULL;
+  }
+}
+
+// close the device once it's been idle for idle_release_time seconds, so that something else can use it
+static void *release_thread_func(void *arg) {
+  pthread_mutex_lock(&alsa_mutex);
+  while (!threads_stop) {
+    uint64_t time_of_release = time_of_last_use+((uint64_t)idle_release_time<<32);
+    uint64_t time_now = get_absolute_time_in_fp();
+    if ((alsa_handle) && (time_now>=time_of_release) && (snd_pcm_state(alsa_handle)!=SND_PCM_STATE_RUNNING)) {
+      debug(1,"Closing the ALSA output device after %d seconds of silence.",idle_release_time);
+      close_alsa_device();
+    }
+    if ((alsa_handle==NULL) || (time_now>=time_of_release)) // check again in a while
+      time_of_release = time_now+((uint64_t)idle_release_time<<32);
+    struct timespec time_of_wakeup;
+    time_of_wakeup.tv_sec = time_of_release>>32;
+    time_of_wakeup.tv_nsec = ((time_of_release&0xffffffff)*1000000000)>>32;
+    pthread_cond_timedwait(&release_cond,&alsa_mutex,&time_of_wakeup);
+  }
+  pthread_mutex_unlock(&alsa_mutex);
+  return NULL;
+}
+
+// alsa_mutex must be held
+static int open_if_closed(void) {
+  int ret = 0;
+	if (alsa_handle==NULL) {
+		ret = open_alsa_device();
+		if ((ret==0) && (audio_alsa.volume))
+		  volume(set_volume);
+	}
+  return ret;
+}
+
+// with the start threshold disabled, the device must be started once frames have been written to it --
+// unless it's to be started at a set time. alsa_mutex must be held.
+static void start_if_due(void) {
+  if ((time_of_start==0) && (snd_pcm_state(alsa_handle)==SND_PCM_STATE_PREPARED)) {
+    time_of_measurement = 0;
+    int err = snd_pcm_start(alsa_handle);
+    if (err<0)
+      debug(1,"Error starting the output device: %s.",snd_strerror(err));
+  }
+}
+
+static int start_at(uint64_t time) {
+  int ret;
+  pthread_mutex_lock(&alsa_mutex);
+  ret = open_if_closed(); // now, rather than when the first frames come
+  if ((ret==0) && (snd_pcm_state(alsa_handle)==SND_PCM_STATE_PREPARED)) {
+    time_of_start = time;
+    pthread_cond_signal(&start_cond);
+  } else {
+    ret = -1;
+  }
+  pthread_mutex_unlock(&alsa_mutex);
+  return ret;
+}
+
+// start the device at time_of_start, with whatever has been written to it by then
+static void *start_thread_func(void *arg) {
+  pthread_mutex_lock(&alsa_mutex);
+  while (!threads_stop) {
+    uint64_t time = time_of_start;
+    if (time==0) {
+      pthread_cond_wait(&start_cond,&alsa_mutex);
+      continue;
+    }
+    pthread_mutex_unlock(&alsa_mutex);
+    struct timespec time_to_start;
+    time_to_start.tv_sec = time>>32;
+    time_to_start.tv_nsec = ((time&0xffffffff)*1000000000)>>32;
+    while (clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&time_to_start,NULL)==EINTR);
+    pthread_mutex_lock(&alsa_mutex);
+    if ((time_of_start==time) && (alsa_handle)) { // unless it's been cancelled or changed in the meantime
+      time_of_start = 0;
+      if (snd_pcm_state(alsa_handle)==SND_PCM_STATE_PREPARED) {
+        snd_pcm_sframes_t queued = 0;
+        snd_pcm_delay(alsa_handle,&queued);
+        time_of_measurement = 0;
+        int err = snd_pcm_start(alsa_handle);
+        uint64_t lateness = get_absolute_time_in_fp()-time;
+        if (err<0)
+          debug(1,"Error starting the output device at the set time: %s.",snd_strerror(err));
+        else
+          debug(2,"ALSA output device started %.3f ms after the set time, with %ld frames queued.",(lateness*1000.0)/((uint64_t)1<<32),queued);
+      }
+    }
+  }
+  pthread_mutex_unlock(&alsa_mutex);
+  return NULL;
+}
+
 static void start(int sample_rate) {
   if (sample_rate != 44100)
     die("Unexpected sample rate %d -- only 44,100 supported!",sample_rate);
   desired_sample_rate = sample_rate; // must be a variable
 }
 
+// read the delay from the running device, and the time it was so. alsa_mutex must be held.
+static int measure_delay(void) {
+  snd_pcm_status_t *status;
+  snd_pcm_status_alloca(&status);
+  uint64_t time_before = get_absolute_time_in_fp();
+  int err = snd_pcm_status(alsa_handle,status);
+  uint64_t time_after = get_absolute_time_in_fp();
+  if (err<0)
+    return err;
+  if (snd_pcm_status_get_state(status)!=SND_PCM_STATE_RUNNING)
+    return -EPIPE; // it has stopped -- probably run dry
+  uint64_t time_of_delay = time_before+(time_after-time_before)/2; // as near as we can tell without a time stamp
+  if (hw_timestamps) {
+    snd_htimestamp_t tstamp;
+    snd_pcm_status_get_htstamp(status,&tstamp);
+    uint64_t t = ((uint64_t)tstamp.tv_sec<<32)+((uint64_t)tstamp.tv_nsec<<32)/1000000000;
+    if ((t<=time_after) && (time_after-t<DELAY_MEASUREMENT_INTERVAL)) // use it if it makes sense
+      time_of_delay = t;
+  }
+  measured_delay = snd_pcm_status_get_delay(status);
+  time_of_measurement = time_of_delay;
+  frames_written_since = 0;
+  return 0;
+}
+
+// the delay at the given time, worked out from the last measurement. alsa_mutex must be held.
+static snd_pcm_sframes_t estimated_delay(uint64_t time) {
+  snd_pcm_sframes_t estimate = measured_delay+frames_written_since;
+  if (time>=time_of_measurement)
+    estimate -= ((time-time_of_measurement)*desired_sample_rate)>>32;
+  else
+    estimate += ((time_of_measurement-time)*desired_sample_rate)>>32;
+  return estimate;
+}
+
 static uint32_t delay() {
+  return delay_at(get_absolute_time_in_fp());
+}
+
+static uint32_t delay_at(uint64_t time) {
+	pthread_mutex_lock(&alsa_mutex); // the device may be closed in the meantime if it is idle
 	if (alsa_handle==NULL) {
+		pthread_mutex_unlock(&alsa_mutex);
 		return 0;
 	} else {
-		pthread_mutex_lock(&alsa_mutex);
-		snd_pcm_sframes_t current_avail,current_delay = 0;
+		snd_pcm_sframes_t current_delay = 0;
 		int derr,ignore;
 		if (snd_pcm_state(alsa_handle)==SND_PCM_STATE_RUNNING) {
-			derr = snd_pcm_avail_delay(alsa_handle,&current_avail,&current_delay);
-			// current_avail not used
-			if (derr != 0) {
-				ignore = snd_pcm_recover(alsa_handle, derr, 0);
-				debug(1,"Error %d in delay(): %s. Delay reported is %d frames.", derr, snd_strerror(derr),current_delay);
-				current_delay=-1;
-			} 
+			int measured = 0;
+			if ((time_of_measurement==0) || ((int64_t)(time-time_of_measurement)>=(int64_t)DELAY_MEASUREMENT_INTERVAL)) {
+				derr = measure_delay();
+				if (derr != 0) {
+					time_of_measurement = 0;
+					ignore = snd_pcm_recover(alsa_handle, derr, 0);
+					debug(1,"Error %d in delay(): %s.", derr, snd_strerror(derr));
+					current_delay=-1;
+				}
+				measured = 1;
+			}
+			if (time_of_measurement) {
+				current_delay = estimated_delay(time);
+				if ((current_delay<=0) && (!measured) && (measure_delay()==0)) // run dry by now, if the estimate is right -- so check
+					current_delay = estimated_delay(time);
+				if (current_delay<0)
+					current_delay = 0;
+			}
 		} else if (snd_pcm_state(alsa_handle)==SND_PCM_STATE_PREPARED) {
 			current_delay=0;
+			if (time_of_start) { // the frames queued up, and the wait until the device is started
+				if (snd_pcm_delay(alsa_handle,&current_delay)!=0)
+					current_delay=0;
+				if (time_of_start>time)
+					current_delay += ((time_of_start-time)*desired_sample_rate)>>32;
+			}
 		} else {
 			if (snd_pcm_state(alsa_handle)==SND_PCM_STATE_XRUN)
 				current_delay=0;
@@ -254,21 +507,25 @@ static uint32_t delay() {
 
 static void play(short buf[], int samples) {
   int ret = 0;
-	if (alsa_handle==NULL) {
-		ret = open_alsa_device();
-		if ((ret==0) && (audio_alsa.volume))
-		  volume(set_volume);
-	}
+  pthread_mutex_lock(&alsa_mutex);
+  ret = open_if_closed();
   if (ret==0) {
-    pthread_mutex_lock(&alsa_mutex);
+    time_of_last_use = get_absolute_time_in_fp();
     snd_pcm_sframes_t current_delay = 0;
     int err,ignore;
     if ((snd_pcm_state(alsa_handle)==SND_PCM_STATE_PREPARED) || (snd_pcm_state(alsa_handle)==SND_PCM_STATE_RUNNING)) {
-      err = snd_pcm_writei(alsa_handle, (char*)buf, samples);
+      if (mmap_access)
+        err = snd_pcm_mmap_writei(alsa_handle, (char*)buf, samples);
+      else
+        err = snd_pcm_writei(alsa_handle, (char*)buf, samples);
       if (err < 0) {
+        time_of_measurement = 0;
         ignore = snd_pcm_recover(alsa_handle, err, 0);
         debug(1,"Error %d writing %d samples in play() %s.",err,samples, snd_strerror(err));
+      } else {
+        frames_written_since += err;
       }
+      start_if_due();
     } else {
       debug(1,"Error -- ALSA device in incorrect state (%d) for play.",snd_pcm_state(alsa_handle));
       if (err = snd_pcm_prepare(alsa_handle)) {
@@ -276,12 +533,58 @@ static void play(short buf[], int samples) {
         debug(1,"Error preparing after play error: %s.", snd_strerror(err));
       }
     }
+  }
+  pthread_mutex_unlock(&alsa_mutex);
+}
+
+// on success, alsa_mutex is held until commit
+static int begin_write(short **buf, int frames) {
+  pthread_mutex_lock(&alsa_mutex);
+  if ((alsa_handle==NULL) || (!mmap_access)) {
     pthread_mutex_unlock(&alsa_mutex);
+    return -1; // play() opens the device
+  }
+  if ((snd_pcm_state(alsa_handle)==SND_PCM_STATE_PREPARED) || (snd_pcm_state(alsa_handle)==SND_PCM_STATE_RUNNING)) {
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(alsa_handle);
+    if (avail>=frames) { // if not, play() waits for room
+      const snd_pcm_channel_area_t *areas;
+      snd_pcm_uframes_t contiguous = frames;
+      int err = snd_pcm_mmap_begin(alsa_handle, &areas, &mmap_offset, &contiguous);
+      if (err < 0) {
+        debug(1,"Error %d getting %d frames of the output buffer: %s.",err,frames,snd_strerror(err));
+      } else if (contiguous<frames) { // the buffer wraps round -- play() copes with that
+        snd_pcm_mmap_commit(alsa_handle, mmap_offset, 0);
+      } else {
+        *buf = (short*)((char*)areas[0].addr + areas[0].first/8 + mmap_offset*(areas[0].step/8));
+        return 0;
+      }
+    }
   }
+  pthread_mutex_unlock(&alsa_mutex);
+  return -1;
+}
+
+static void commit(int frames) {
+  time_of_last_use = get_absolute_time_in_fp();
+  snd_pcm_sframes_t committed = snd_pcm_mmap_commit(alsa_handle, mmap_offset, frames);
+  if (committed>0)
+    frames_written_since += committed;
+  if (committed!=frames) {
+    debug(1,"Error committing %d frames to the output buffer: %s.",frames,committed<0 ? snd_strerror(committed) : "short commit");
+    if (committed<0) {
+      time_of_measurement = 0;
+      (void)snd_pcm_recover(alsa_handle, committed, 0);
+    }
+  }
+  start_if_due();
+  pthread_mutex_unlock(&alsa_mutex);
 }
 
 static void flush(void) {
   int derr;
+  pthread_mutex_lock(&alsa_mutex);
+  time_of_start = 0;
+  time_of_measurement = 0;
   if (alsa_handle) {
     // debug(1,"Dropping frames for flush...");
     if (derr = snd_pcm_drop(alsa_handle))
@@ -299,18 +602,20 @@ static void flush(void) {
     if (!((snd_pcm_state(alsa_handle)==SND_PCM_STATE_PREPARED) || (snd_pcm_state(alsa_handle)==SND_PCM_STATE_RUNNING)))
       debug(1,"Flush returning unexpected state -- %d.",snd_pcm_state(alsa_handle));
     
-    // flush also closes the device
-    snd_pcm_close(alsa_handle);
-    alsa_handle = NULL;
+    // flush also closes the device, unless it's to be kept open -- opening it again can take a good while
+    if (!keep_open)
+      close_alsa_device();
+    // the prepared device is idle from now on
+    time_of_last_use = get_absolute_time_in_fp();
   }
+  pthread_mutex_unlock(&alsa_mutex);
 }
 
 static void stop(void) {
-	if (alsa_handle!=0)
 	  // when we want to stop, we want the alsa device
 	  // to be closed immediately -- we may even be killing the thread, so we don't wish to wait
 	  // so we should flush first
-	  flush(); // flush will also close the device
+	  flush(); // flush will also close the device, unless it's being kept open
 	  // close_alsa_device();
 }
 
@@ -0,0 +1,262 @@
+/*
+ * Output writer thread. This file is part of Shairport Sync.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "common.h"
+#include "audio.h"
+
+// The player puts its frames into a ring buffer, and a thread of our own passes them on to the
+// backend -- so that it's this thread, rather than the player, that waits if the backend blocks.
+// The ring is single producer, single consumer: the player advances ring_written, the writer ring_read.
+// The frames in the ring are counted in the delay, so a backend that can't tell its own delay can still
+// be kept in sync, after a fashion: what it holds itself is then taken as part of the latency.
+// A flush doesn't wait for the writer either: the player marks the frames written so far as stale, and the
+// writer drops them, and flushes the backend, as soon as it's back from the backend.
+
+#define RING_FRAMES 32768 // about 0.75 seconds -- far more than the player ever queues up; a power of two
+#define WRITE_CHUNK 1024 // the most frames passed to the backend at a time
+
+static audio_output *backend;
+static audio_output buffered;
+
+static short ring[RING_FRAMES*2];
+static uint64_t ring_written; // frames put in by the player
+static uint64_t ring_read; // frames passed on to the backend
+static int rate;
+
+// a backend with no delay of its own will probably block while it plays what it's given, or until it has room for it,
+// so while it has a chunk of frames, they are taken to be going at the sample rate
+static uint64_t chunk_time; // when the writer handed the chunk over
+static uint32_t chunk_frames; // zero if the writer isn't in the backend
+
+static uint32_t flushes_requested; // written by the player
+static uint32_t flushes_done; // written by the writer: when it's the same as flushes_requested, there's no flush pending
+static uint64_t flush_point; // written by the player: the frames before this are stale
+
+static pthread_t writer_thread;
+static int writer_running;
+// ring_mutex and ring_cond are for the writer to wait for frames or a flush, and for stop() to wait for the writer
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+static int writer_waiting; // the writer is waiting, not using the backend
+static int writer_stop;
+
+static inline uint32_t ring_fill(void) {
+  return ring_written-__atomic_load_n(&ring_read,__ATOMIC_SEQ_CST);
+}
+
+static inline int flush_pending(void) {
+  return __atomic_load_n(&flushes_requested,__ATOMIC_SEQ_CST)!=__atomic_load_n(&flushes_done,__ATOMIC_SEQ_CST);
+}
+
+// called from the writer thread, or from the player's when there is no writer
+static void drop_stale_frames(void) {
+  uint32_t requested = __atomic_load_n(&flushes_requested,__ATOMIC_ACQUIRE);
+  uint64_t point = __atomic_load_n(&flush_point,__ATOMIC_ACQUIRE);
+  if (point>ring_read)
+    __atomic_store_n(&ring_read,point,__ATOMIC_SEQ_CST);
+  if (backend->flush)
+    backend->flush();
+  __atomic_store_n(&flushes_done,requested,__ATOMIC_SEQ_CST);
+}
+
+static void *writer_thread_func(void *arg) {
+  pthread_mutex_lock(&ring_mutex);
+  while (!writer_stop) {
+    if (flush_pending()) {
+      pthread_mutex_unlock(&ring_mutex);
+      drop_stale_frames();
+      pthread_mutex_lock(&ring_mutex);
+      continue;
+    }
+    uint64_t read = ring_read;
+    if (__atomic_load_n(&ring_written,__ATOMIC_SEQ_CST)==read) {
+      __atomic_store_n(&writer_waiting,1,__ATOMIC_SEQ_CST);
+      pthread_cond_broadcast(&ring_cond); // stop() may be waiting for this
+      // look again, now that the player will wake us for any more frames or a flush
+      if ((!flush_pending()) && (__atomic_load_n(&ring_written,__ATOMIC_SEQ_CST)==read))
+        pthread_cond_wait(&ring_cond,&ring_mutex);
+      __atomic_store_n(&writer_waiting,0,__ATOMIC_SEQ_CST);
+      continue;
+    }
+    pthread_mutex_unlock(&ring_mutex);
+
+    uint32_t frames = __atomic_load_n(&ring_written,__ATOMIC_ACQUIRE)-read;
+    uint32_t offset = read&(RING_FRAMES-1);
+    if (frames>RING_FRAMES-offset)
+      frames = RING_FRAMES-offset; // up to the end of the ring, this time round
+    if (frames>WRITE_CHUNK)
+      frames = WRITE_CHUNK;
+    // the frames stay in the ring, and so in the delay, until the backend has them
+    __atomic_store_n(&chunk_time,get_absolute_time_in_fp(),__ATOMIC_SEQ_CST);
+    __atomic_store_n(&chunk_frames,frames,__ATOMIC_SEQ_CST);
+    backend->play(ring+2*offset,frames);
+    __atomic_store_n(&chunk_frames,0,__ATOMIC_SEQ_CST); // before they leave the ring, so that they're never missed out
+    // if the player flushed meanwhile, the backend is flushed next time round
+
+    pthread_mutex_lock(&ring_mutex);
+    __atomic_store_n(&ring_read,read+frames,__ATOMIC_SEQ_CST);
+  }
+  pthread_mutex_unlock(&ring_mutex);
+  return NULL;
+}
+
+static void wake_writer(void) {
+  if (__atomic_load_n(&writer_waiting,__ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&ring_mutex);
+    pthread_cond_broadcast(&ring_cond);
+    pthread_mutex_unlock(&ring_mutex);
+  }
+}
+
+static void start(int sample_rate) {
+  backend->start(sample_rate);
+  rate = sample_rate;
+  writer_stop = 0;
+  ring_read = ring_written = flush_point = 0;
+  flushes_done = flushes_requested;
+  pthread_create(&writer_thread, NULL, writer_thread_func, NULL);
+  writer_running = 1;
+
+  // the backend mustn't be kept waiting, so ask for a real-time priority -- though it may not be allowed
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = sched_get_priority_min(SCHED_FIFO)+1;
+  int rc = pthread_setschedparam(writer_thread, SCHED_FIFO, &param);
+  if (rc)
+    debug(1,"Output writer thread running without real-time priority: %s.",strerror(rc));
+}
+
+static void stop_writer(void) {
+  if (writer_running) {
+    pthread_mutex_lock(&ring_mutex);
+    writer_stop = 1;
+    pthread_cond_broadcast(&ring_cond);
+    pthread_mutex_unlock(&ring_mutex);
+    pthread_join(writer_thread, NULL);
+    writer_running = 0;
+    ring_read = ring_written;
+    flushes_done = flushes_requested; // the backend is stopped instead
+  }
+}
+
+static void stop(void) {
+  stop_writer();
+  backend->stop();
+}
+
+static void deinit(void) {
+  stop_writer();
+  backend->deinit();
+}
+
+// called from the player thread
+static void play(short buf[], int samples) {
+  uint32_t room = RING_FRAMES-ring_fill();
+  if (samples>room) {
+    // only if the backend has stalled: the player waits for the delay, which includes the ring, to come down
+    debug(1,"Output ring full -- dropping %d frames.",samples-room);
+    samples = room;
+  }
+  uint32_t offset = ring_written&(RING_FRAMES-1);
+  uint32_t first = samples;
+  if (first>RING_FRAMES-offset)
+    first = RING_FRAMES-offset;
+  memcpy(ring+2*offset,buf,first*4);
+  memcpy(ring,buf+2*first,(samples-first)*4);
+  __atomic_store_n(&ring_written,ring_written+samples,__ATOMIC_SEQ_CST);
+  wake_writer();
+}
+
+static int begin_write(short **buf, int frames) {
+  uint32_t offset = ring_written&(RING_FRAMES-1);
+  if ((frames>RING_FRAMES-ring_fill()) || (frames>RING_FRAMES-offset))
+    return -1; // no room, or not in one piece -- play() copes with that
+  *buf = ring+2*offset;
+  return 0;
+}
+
+static void commit(int frames) {
+  __atomic_store_n(&ring_written,ring_written+frames,__ATOMIC_SEQ_CST);
+  wake_writer();
+}
+
+// doesn't wait for the writer, which may be held up in the backend: it does the flush when it can
+static void flush(void) {
+  __atomic_store_n(&flush_point,ring_written,__ATOMIC_RELEASE);
+  __atomic_add_fetch(&flushes_requested,1,__ATOMIC_SEQ_CST);
+  if (writer_running)
+    wake_writer();
+  else
+    drop_stale_frames();
+}
+
+static uint32_t delay_at(uint64_t time) {
+  uint32_t backend_delay = 0;
+  // while a flush is pending, the stale frames don't count, and the backend is as good as empty
+  int flushing = flush_pending();
+  if (!flushing) {
+    if (backend->delay_at)
+      backend_delay = backend->delay_at(time);
+    else if (backend->delay)
+      backend_delay = backend->delay();
+  }
+  if (backend_delay==-1)
+    return -1;
+  uint64_t read = __atomic_load_n(&ring_read,__ATOMIC_SEQ_CST);
+  uint64_t point = __atomic_load_n(&flush_point,__ATOMIC_ACQUIRE);
+  uint32_t queued = ring_written-(point>read ? point : read);
+  if ((!flushing) && (backend->delay_at==NULL) && (backend->delay==NULL)) {
+    uint32_t frames = __atomic_load_n(&chunk_frames,__ATOMIC_SEQ_CST);
+    uint64_t handed_over = __atomic_load_n(&chunk_time,__ATOMIC_SEQ_CST);
+    if ((frames) && (time>handed_over)) {
+      uint64_t gone = ((time-handed_over)*rate)>>32;
+      queued -= gone<frames ? gone : frames;
+    }
+  }
+  // while the writer is passing frames on to a backend with a delay, they may be counted twice for a moment
+  return backend_delay+queued;
+}
+
+static uint32_t delay() {
+  return delay_at(get_absolute_time_in_fp());
+}
+
+audio_output *audio_buffered(audio_output *output) {
+  backend = output;
+  buffered = *output; // the name, help, init, volume and start_at are the backend's own
+  buffered.deinit = &deinit;
+  buffered.start = &start;
+  buffered.stop = &stop;
+  buffered.flush = &flush;
+  buffered.play = &play;
+  buffered.begin_write = &begin_write;
+  buffered.commit = &commit;
+  buffered.delay = &delay;
+  buffered.delay_at = &delay_at;
+  return &buffered;
+}
@@ -0,0 +1,488 @@
+/*
+ * ALAC decoder benchmark. This file is part of Shairport Sync.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * shairport-bench runs the receive-side decode path -- AES-CBC decryption
+ * followed by alac_decode_frame -- over a corpus of recorded packets in a
+ * tight loop, and reports the time per packet and a checksum of the PCM.
+ *
+ * The corpus file starts with text lines describing the stream, as
+ * they would be taken from the ANNOUNCE:
+ *
+ *   fmtp: 96 352 0 16 40 10 14 2 255 0 0 44100
+ *   aeskey: <32 hex digits, the AES key after RSA decryption>
+ *   aesiv: <32 hex digits>
+ *
+ * Lines starting with '#' are ignored. If aeskey is missing the payloads
+ * are taken to be unencrypted. An empty line ends the header; it is
+ * followed by the packets, each a two byte big-endian length and the RTP
+ * audio payload (the packet without its 12 byte RTP header).
+ *
+ * With -c, only the decryption is timed, and the throughput is reported in MB/s.
+ *
+ * With -v, only the software volume control is timed, on the decoded audio.
+ *
+ * With -s, the decoded audio is put through the soxr resampler the way the
+ * player does it with "-S soxr", and the CPU time it takes is reported in
+ * seconds per hour of audio.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "config.h"
+
+#include "alac.h"
+#include "aescbc.h"
+#include "softvol.h"
+
+#ifdef HAVE_LIBSOXR
+#include <soxr.h>
+#endif
+
+#define MAX_PACKET 2048
+
+typedef struct {
+  uint16_t len;
+  uint8_t *data;
+} bench_packet;
+
+static int32_t fmtp[12];
+static int fmtp_present;
+static unsigned char aeskey[16], aesiv[16];
+static int aeskey_present, aesiv_present;
+
+static aescbc_key aes_key;
+
+static alac_file *decoder_info;
+
+static void usage(char *progname) {
+  printf("Usage: %s [options...] corpus-file\n", progname);
+  printf("\n");
+  printf("Options:\n");
+  printf("    -h                  show this help\n");
+  printf("    -i iterations       number of passes over the corpus (default 100)\n");
+  printf("    -c                  time only the decryption, and report it in MB/s\n");
+  printf("    -v                  time only the software volume control\n");
+#ifdef HAVE_LIBSOXR
+  printf("    -s                  time the soxr resampler, and report it in CPU seconds per hour of audio\n");
+#endif
+  printf("\n");
+  printf("Decodes every packet of the corpus in a tight loop, exactly as the player\n");
+  printf("does, and prints the time per packet and a checksum of the PCM output.\n");
+}
+
+static double now_ns(void) {
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec tn;
+  clock_gettime(CLOCK_MONOTONIC, &tn);
+  return tn.tv_sec * 1e9 + tn.tv_nsec;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1e9 + tv.tv_usec * 1e3;
+#endif
+}
+
+static int hex_decode(const char *in, unsigned char *out, int outlen) {
+  int i;
+  for (i = 0; i < outlen; i++) {
+    unsigned int byte;
+    if (sscanf(in + 2 * i, "%2x", &byte) != 1)
+      return -1;
+    out[i] = byte;
+  }
+  return 0;
+}
+
+static int read_header(FILE *f) {
+  char line[1024];
+  while (fgets(line, sizeof(line), f)) {
+    char *p = line;
+    line[strcspn(line, "\r\n")] = 0;
+    if (*p == 0)
+      return 0;
+    if (*p == '#')
+      continue;
+    if (!strncmp(p, "fmtp:", 5)) {
+      int i = 0;
+      p += 5;
+      while (i < 12) {
+        char *end;
+        long v = strtol(p, &end, 10);
+        if (end == p)
+          break;
+        fmtp[i++] = v;
+        p = end;
+      }
+      if (i != 12) {
+        fprintf(stderr, "fmtp needs 12 values, found %d\n", i);
+        return -1;
+      }
+      fmtp_present = 1;
+    } else if (!strncmp(p, "aeskey:", 7)) {
+      p += 7 + strspn(p + 7, " \t");
+      if (hex_decode(p, aeskey, 16)) {
+        fprintf(stderr, "bad aeskey\n");
+        return -1;
+      }
+      aeskey_present = 1;
+    } else if (!strncmp(p, "aesiv:", 6)) {
+      p += 6 + strspn(p + 6, " \t");
+      if (hex_decode(p, aesiv, 16)) {
+        fprintf(stderr, "bad aesiv\n");
+        return -1;
+      }
+      aesiv_present = 1;
+    } else {
+      fprintf(stderr, "unrecognised header line \"%s\"\n", line);
+      return -1;
+    }
+  }
+  fprintf(stderr, "no packets follow the header\n");
+  return -1;
+}
+
+static bench_packet *read_packets(FILE *f, int *count) {
+  bench_packet *packets = NULL;
+  int n = 0, allocated = 0;
+  unsigned char lenbuf[2];
+  while (fread(lenbuf, 1, 2, f) == 2) {
+    uint16_t len = (lenbuf[0] << 8) | lenbuf[1];
+    if (len == 0 || len > MAX_PACKET) {
+      fprintf(stderr, "packet %d has a bad length %u\n", n, len);
+      break;
+    }
+    if (n == allocated) {
+      allocated = allocated ? allocated * 2 : 1024;
+      packets = realloc(packets, allocated * sizeof(bench_packet));
+      if (!packets) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    packets[n].len = len;
+    packets[n].data = malloc(len);
+    if (!packets[n].data || fread(packets[n].data, 1, len, f) != len) {
+      fprintf(stderr, "packet %d is truncated\n", n);
+      free(packets[n].data);
+      break;
+    }
+    n++;
+  }
+  *count = n;
+  return packets;
+}
+
+static int init_decoder(void) {
+  alac_file *alac;
+
+  if (fmtp[3] != 16) {
+    fprintf(stderr, "only 16-bit samples supported!\n");
+    return -1;
+  }
+
+  alac = alac_create(fmtp[3], 2);
+  if (!alac)
+    return -1;
+  decoder_info = alac;
+
+  alac->setinfo_max_samples_per_frame = fmtp[1];
+  alac->setinfo_7a = fmtp[2];
+  alac->setinfo_sample_size = fmtp[3];
+  alac->setinfo_rice_historymult = fmtp[4];
+  alac->setinfo_rice_initialhistory = fmtp[5];
+  alac->setinfo_rice_kmodifier = fmtp[6];
+  alac->setinfo_7f = fmtp[7];
+  alac->setinfo_80 = fmtp[8];
+  alac->setinfo_82 = fmtp[9];
+  alac->setinfo_86 = fmtp[10];
+  alac->setinfo_8a_rate = fmtp[11];
+  alac_allocate_buffers(alac);
+  return 0;
+}
+
+// the same steps as alac_decode in player.c -- except that the player decrypts
+// the packet where it was received, and here the corpus has to be left intact
+static int decode_packet(short *dest, uint8_t *buf, int len) {
+  unsigned char packet[MAX_PACKET];
+  int outsize;
+
+  memcpy(packet, buf, len);
+  if (aeskey_present)
+    aescbc_decrypt(&aes_key, aesiv, packet, len & ~0xf);
+
+  alac_decode_frame(decoder_info, packet, len, dest, &outsize);
+  return outsize;
+}
+
+#ifdef HAVE_LIBSOXR
+static double cpu_seconds(void) {
+  struct timespec tn;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tn);
+  return tn.tv_sec + tn.tv_nsec * 1e-9;
+}
+
+// One packet in three is corrected, which is a good deal more than the player
+// would ever need. First the audio goes through one streaming variable-rate
+// resampler, as the player does it, then through a soxr_oneshot for each
+// corrected packet, for comparison.
+static void bench_resampler(short *pcm, int npackets, int frames, int iterations) {
+  soxr_io_spec_t io_spec = soxr_io_spec(SOXR_INT16_I, SOXR_INT16_I);
+  soxr_quality_spec_t q_spec = soxr_quality_spec(SOXR_HQ, SOXR_VR);
+  soxr_error_t error;
+  short *out = malloc(4 * 2 * frames);
+  double start, streaming, oneshot, hours;
+  int it, i, stuff, last_stuff = 0;
+  size_t idone, odone;
+
+  soxr_t resampler = soxr_create(2.0, 1.0, 2, &error, &io_spec, &q_spec, NULL);
+  if (error || !out) {
+    fprintf(stderr, "can't set up the resampler: %s\n", error ? soxr_strerror(error) : "out of memory");
+    exit(EXIT_FAILURE);
+  }
+  soxr_set_io_ratio(resampler, 1.0, 0);
+
+  start = cpu_seconds();
+  for (it = 0; it < iterations; it++)
+    for (i = 0; i < npackets; i++) {
+      stuff = (i % 3 == 0) ? 1 : 0;
+      if (stuff != last_stuff) {
+        soxr_set_io_ratio(resampler, (double)frames / (frames + stuff), frames);
+        last_stuff = stuff;
+      }
+      soxr_process(resampler, pcm + 2 * frames * i, frames, &idone, out, 2 * frames, &odone);
+    }
+  streaming = cpu_seconds() - start;
+  soxr_delete(resampler);
+
+  io_spec.scale = 1.0;
+  start = cpu_seconds();
+  for (it = 0; it < iterations; it++)
+    for (i = 0; i < npackets; i += 3)
+      soxr_oneshot(frames, frames + 1, 2, pcm + 2 * frames * i, frames, NULL,
+                   out, frames + 1, &odone, &io_spec, NULL, NULL);
+  oneshot = cpu_seconds() - start;
+
+  hours = (double)npackets * iterations * frames / (fmtp[11] * 3600.0);
+  printf("packets:        %d x %d iterations\n", npackets, iterations);
+  printf("streaming:      %.2f CPU s/hour of audio\n", streaming / hours);
+  printf("oneshot:        %.2f CPU s/hour of audio\n", oneshot / hours);
+  free(out);
+}
+#endif
+
+// 64-bit FNV-1a
+static uint64_t checksum_update(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *p = data;
+  while (len--) {
+    hash ^= *p++;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+int main(int argc, char **argv) {
+  int iterations = 100, crypto_only = 0, volume_only = 0;
+#ifdef HAVE_LIBSOXR
+  int resampler_only = 0;
+#endif
+  int opt, i, it, npackets;
+  FILE *f;
+  bench_packet *packets;
+  short *pcm;
+  uint64_t checksum = 0xcbf29ce484222325ULL;
+  double start, elapsed;
+
+  while ((opt = getopt(argc, argv, "hi:cvs")) > 0) {
+    switch (opt) {
+    case 'i':
+      iterations = atoi(optarg);
+      break;
+    case 'c':
+      crypto_only = 1;
+      break;
+    case 'v':
+      volume_only = 1;
+      break;
+#ifdef HAVE_LIBSOXR
+    case 's':
+      resampler_only = 1;
+      break;
+#endif
+    case 'h':
+      usage(argv[0]);
+      exit(EXIT_SUCCESS);
+    default:
+      usage(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (optind != argc - 1 || iterations < 1) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  f = fopen(argv[optind], "rb");
+  if (!f) {
+    perror(argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+  if (read_header(f))
+    exit(EXIT_FAILURE);
+  if (!fmtp_present) {
+    fprintf(stderr, "the corpus has no fmtp line\n");
+    exit(EXIT_FAILURE);
+  }
+  if (aeskey_present && !aesiv_present) {
+    fprintf(stderr, "the corpus has an aeskey but no aesiv\n");
+    exit(EXIT_FAILURE);
+  }
+  packets = read_packets(f, &npackets);
+  fclose(f);
+  if (npackets == 0) {
+    fprintf(stderr, "the corpus has no packets\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (init_decoder())
+    exit(EXIT_FAILURE);
+  aescbc_set_decrypt_key(&aes_key, aeskey);
+
+  if (crypto_only) {
+    double bytes = 0;
+    if (!aeskey_present) {
+      fprintf(stderr, "the corpus is not encrypted\n");
+      exit(EXIT_FAILURE);
+    }
+    // the packets are decrypted over and over where they are -- it takes as long as decrypting them once
+    for (i = 0; i < npackets; i++)
+      bytes += packets[i].len & ~0xf;
+    start = now_ns();
+    for (it = 0; it < iterations; it++)
+      for (i = 0; i < npackets; i++)
+        aescbc_decrypt(&aes_key, aesiv, packets[i].data, packets[i].len & ~0xf);
+    elapsed = now_ns() - start;
+
+    printf("decryption:     %s\n", aescbc_implementation());
+    printf("packets:        %d x %d iterations\n", npackets, iterations);
+    printf("ns/packet:      %.1f\n", elapsed / ((double)npackets * iterations));
+    printf("MB/s:           %.1f\n", bytes * iterations * 1e3 / elapsed);
+    exit(EXIT_SUCCESS);
+  }
+
+  if (volume_only) {
+    softvol_dither dither;
+    short *out;
+    pcm = calloc(npackets, 4 * (fmtp[1] + 3));
+    out = malloc(4 * (fmtp[1] + 3));
+    if (!pcm || !out) {
+      fprintf(stderr, "out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < npackets; i++)
+      decode_packet(pcm + 2 * fmtp[1] * i, packets[i].data, packets[i].len);
+    // about -10 dB, with a ramp to a slightly different level on every eighth packet, and back on the next
+    int32_t previous = 0x5100;
+
+    // one untimed pass from a fresh dither state to warm up the caches and compute the checksum
+    softvol_dither_init(&dither);
+    for (i = 0; i < npackets; i++) {
+      int32_t gain = (i % 8 == 0) ? 0x5000 : 0x5100;
+      softvol_apply(&dither, out, pcm + 2 * fmtp[1] * i, fmtp[1], previous, gain);
+      previous = gain;
+      checksum = checksum_update(checksum, out, fmtp[1] * 4);
+    }
+
+    start = now_ns();
+    for (it = 0; it < iterations; it++)
+      for (i = 0; i < npackets; i++) {
+        int32_t gain = (i % 8 == 0) ? 0x5000 : 0x5100;
+        softvol_apply(&dither, out, pcm + 2 * fmtp[1] * i, fmtp[1], previous, gain);
+        previous = gain;
+      }
+    elapsed = now_ns() - start;
+
+    printf("volume:         %s\n", softvol_implementation());
+    printf("packets:        %d x %d iterations\n", npackets, iterations);
+    printf("ns/packet:      %.1f\n", elapsed / ((double)npackets * iterations));
+    printf("ns/sample:      %.3f\n", elapsed / ((double)npackets * iterations * fmtp[1] * 2));
+    printf("checksum:       %016llx\n", (unsigned long long)checksum);
+    exit(EXIT_SUCCESS);
+  }
+
+#ifdef HAVE_LIBSOXR
+  if (resampler_only) {
+    // decode the corpus once, a whole packet of frames for each packet
+    pcm = calloc(npackets, 4 * (fmtp[1] + 3));
+    if (!pcm) {
+      fprintf(stderr, "out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < npackets; i++)
+      decode_packet(pcm + 2 * fmtp[1] * i, packets[i].data, packets[i].len);
+    bench_resampler(pcm, npackets, fmtp[1], iterations);
+    exit(EXIT_SUCCESS);
+  }
+#endif
+
+  pcm = malloc(4 * (fmtp[1] + 3));
+  if (!pcm) {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // one untimed pass to warm up the caches and compute the checksum
+  for (i = 0; i < npackets; i++) {
+    int outsize = decode_packet(pcm, packets[i].data, packets[i].len);
+    checksum = checksum_update(checksum, pcm, outsize);
+  }
+
+  start = now_ns();
+  for (it = 0; it < iterations; it++)
+    for (i = 0; i < npackets; i++)
+      decode_packet(pcm, packets[i].data, packets[i].len);
+  elapsed = now_ns() - start;
+
+  printf("decryption:     %s\n", aeskey_present ? aescbc_implementation() : "none");
+  printf("decoder:        %s\n", alac_implementation());
+  printf("packets:        %d x %d iterations\n", npackets, iterations);
+  printf("ns/packet:      %.1f\n", elapsed / ((double)npackets * iterations));
+  printf("packets/s:      %.0f\n", (double)npackets * iterations * 1e9 / elapsed);
+  printf("realtime x:     %.1f\n",
+         (double)npackets * iterations * fmtp[1] * 1e9 / (elapsed * fmtp[11]));
+  printf("pcm checksum:   %016llx\n", (unsigned long long)checksum);
+
+  for (i = 0; i < npackets; i++)
+    free(packets[i].data);
+  free(packets);
+  free(pcm);
+  alac_free(decoder_info);
+  return 0;
+}
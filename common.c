@@ -32,6 +32,7 @@
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <popt.h>
 
 #include <assert.h>
@@ -255,17 +256,31 @@ static char super_secret_key[] =
 "2gG0N5hvJpzwwhbhXqFKA4zaaSrw622wDniAK5MlIE0tIAKKP4yxNGjoD2QYjhBGuhvkWKY=\n"
 "-----END RSA PRIVATE KEY-----\0";
 
+// The private key is parsed only once, the first time it's needed -- rsa_key_init() is called at startup
+// so that this doesn't hold up the first connection. Conversation threads can overlap, so it is used under rsa_mutex.
+static pthread_once_t rsa_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t rsa_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 #ifdef HAVE_LIBSSL
-uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
 static RSA *rsa = NULL;
 
-	if (!rsa) {
-		BIO *bmem = BIO_new_mem_buf(super_secret_key, -1);
-		rsa = PEM_read_bio_RSAPrivateKey(bmem, NULL, NULL, NULL);
-		BIO_free(bmem);
-	}
+static void rsa_load_key(void) {
+  BIO *bmem = BIO_new_mem_buf(super_secret_key, -1);
+  rsa = PEM_read_bio_RSAPrivateKey(bmem, NULL, NULL, NULL);
+  BIO_free(bmem);
+  if (!rsa)
+    die("Can't read the private key.");
+}
+
+void rsa_key_init(void) {
+  pthread_once(&rsa_once,rsa_load_key);
+}
+
+uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
+	rsa_key_init();
 
 	uint8_t *out = malloc(RSA_size(rsa));
+	pthread_mutex_lock(&rsa_mutex);
 	switch (mode) {
 		case RSA_MODE_AUTH:
 			*outlen = RSA_private_encrypt(inlen, input, out, rsa,
@@ -278,18 +293,21 @@ static RSA *rsa = NULL;
 		default:
 			die("bad rsa mode");
 	}
+	pthread_mutex_unlock(&rsa_mutex);
 	return out;
 }
 #endif
 
 #ifdef HAVE_LIBPOLARSSL
-uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
-    rsa_context trsa;
+// the parsed key includes the CRT parameters (DP, DQ, QP), so private key operations use the CRT
+static rsa_context trsa;
+static entropy_context entropy;
+static ctr_drbg_context ctr_drbg;
+
+static void rsa_load_key(void) {
     const char *pers = "rsa_encrypt";
     int rc;
-    
-    entropy_context entropy;
-    ctr_drbg_context ctr_drbg;
+
     entropy_init( &entropy );
     if( ( rc = ctr_drbg_init( &ctr_drbg, entropy_func, &entropy,(const unsigned char *) pers,strlen( pers ) ) ) != 0 )
       debug(1, "ctr_drbg_init returned %d\n", rc );
@@ -298,10 +316,20 @@ uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
     // BTW, this seems to reset a lot of parameters in the rsa_context
     rc = x509parse_key(&trsa,(unsigned char *)super_secret_key,strlen(super_secret_key),NULL,0);
     if (rc!=0)
-      debug(1,"Error %d reading the private key.");
-      
+      die("Error %d reading the private key.",rc);
+}
+
+void rsa_key_init(void) {
+  pthread_once(&rsa_once,rsa_load_key);
+}
+
+uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
+    int rc;
+
+    rsa_key_init();
     uint8_t *out = NULL;
 
+    pthread_mutex_lock(&rsa_mutex);
     switch (mode) {
         case RSA_MODE_AUTH:
             trsa.padding = RSA_PKCS_V15;
@@ -329,7 +357,7 @@ uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
         default:
             die("bad rsa mode");
     }
-    rsa_free(&trsa);
+    pthread_mutex_unlock(&rsa_mutex);
     debug(2,"rsa_apply exit");
     return out;
 }
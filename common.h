@@ -36,6 +36,11 @@ enum stuffing_type {
   ST_soxr,
 } type;
 
+enum sync_mode_type {
+  SM_threshold    = 0, // correct the sync error when it goes beyond the tolerance
+  SM_pll,              // correct it continuously, with a phase-locked loop
+};
+
 
 
 typedef struct {
@@ -51,6 +56,11 @@ typedef struct {
     char *mdns_name;
     mdns_backend *mdns;
     int buffer_start_fill;
+    int buffer_packets; // size of the audio buffer in packets -- rounded up to a power of two
+    int lock_buffer; // if true, lock the audio buffer into memory
+    int decode_on_play; // if true, keep packets in the audio buffer as received and decode them just before they are played
+    int output_thread; // if true, pass frames to the output from a thread of its own, so that the player never waits for it
+    int output_batch; // if true, write the output of several packets at a time, when they're ready
     uint32_t latency;
     uint32_t userSuppliedLatency; // overrides all other latencies -- use with caution
     uint32_t iTunesLatency; // supplied with --iTunesLatency option
@@ -62,6 +72,7 @@ typedef struct {
     int tolerance; // allow this much drift before attempting to correct it
     int cmd_blocking;
     enum stuffing_type packet_stuffing;
+    enum sync_mode_type sync_mode;
     char *pidfile;
     char *logfile;
     char *errfile;
@@ -84,6 +95,7 @@ char *base64_enc(uint8_t *input, int length);
 
 #define RSA_MODE_AUTH (0)
 #define RSA_MODE_KEY  (1)
+void rsa_key_init(void); // parse the private key ahead of the first rsa_apply
 uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode);
 
 // given a volume (0 to -30) and high and low attenuations in dB*100 (e.g. 0 to -6000 for 0 to -60 dB), return an attenuation depending on the transfer function
@@ -42,18 +42,15 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
 
 #include "config.h"
 
 #ifdef HAVE_LIBPOLARSSL
-#include <polarssl/aes.h>
 #include <polarssl/havege.h>
 #endif
 
-#ifdef HAVE_LIBSSL
-#include <openssl/aes.h>
-#endif
-
 #ifdef HAVE_LIBSOXR
 #include <soxr.h>
 #endif
@@ -64,22 +61,19 @@
 #include "rtsp.h"
 
 #include "alac.h"
+#include "aescbc.h"
+#include "softvol.h"
 
 // parameters from the source
+static int encrypted;
 static unsigned char *aesiv;
-#ifdef HAVE_LIBSSL
-static AES_KEY aes;
-#endif
+static aescbc_key aes_key;
 static int sampling_rate, frame_size;
 
-#define FRAME_BYTES(frame_size) (4*frame_size)
+#define FRAME_BYTES(frame_size) (4*(frame_size))
 // maximal resampling shift - conservative
 #define OUTFRAME_BYTES(frame_size) (4*(frame_size+3))
 
-#ifdef  HAVE_LIBPOLARSSL
-static aes_context dctx;
-#endif
-
 static pthread_t player_thread;
 static int please_stop;
 
@@ -95,114 +89,225 @@ static int32_t last_seqno_read;
 
 
 // interthread variables
-static double volume = 1.0;
-static int fix_volume = 0x10000;
-static pthread_mutex_t vol_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int32_t fix_volume = SOFTVOL_UNITY; // the software volume asked for -- use the __atomic builtins on it
 
-// default buffer size
-// needs to be a power of 2 because of the way BUFIDX(seqno) works
-#define BUFFER_FRAMES  512
 #define MAX_PACKET      2048
+// room for a packet as received in each slot of the audio buffer, if config.decode_on_play -- most are smaller
+#define PAYLOAD_BYTES    768
+
+// packets the audio buffer needs over and above those waiting out the latency
+#define BUFFER_MARGIN 64
 
 // DAC buffer occupancy stuff
 #define DAC_BUFFER_QUEUE_DESIRED_LENGTH 6615
 #define DAC_BUFFER_QUEUE_MINIMUM_LENGTH 5000
 
-typedef struct audio_buffer_entry {   // decoded audio packets
-  int ready;
+// The audio buffer is a single-producer, single-consumer ring: only the RTP audio receiver
+// thread puts packets into it and only the player thread takes them out, so it needs no locks.
+// Packets are identified by extended sequence numbers -- 64 bits, so they never wrap,
+// with the RTP sequence number in the bottom 16 bits.
+// A slot holds the packet whose extended sequence number is in its "ready" field;
+// the producer fills in the rest of the slot first and then stores "ready" with release semantics,
+// and the consumer loads "ready" with acquire semantics before it touches the rest.
+
+typedef struct audio_buffer_entry {   // decoded audio packets, or packets as received if config.decode_on_play
+  uint64_t ready; // extended seqno of the packet in this slot, zero if none
   uint32_t timestamp;
   seq_t sequence_number;
   signed short *data;
+  uint8_t *payload; // the packet as received -- only used if config.decode_on_play
+  int length; // of the packet in payload
+  int capacity; // of payload -- if a packet doesn't fit, it is replaced with a bigger one, off the heap
 } abuf_t;
-static abuf_t audio_buffer[BUFFER_FRAMES];
-#define BUFIDX(seqno) ((seq_t)(seqno) % BUFFER_FRAMES)
 
-// mutex-protected variables
-static seq_t ab_read, ab_write;
-static int ab_buffering = 1, ab_synced = 0;
-static uint32_t first_packet_timestamp = 0;
-static int flush_requested = 0;
+// The slots and their audio are allocated together in one page-aligned arena,
+// which is prefaulted, and locked into memory if requested.
+static abuf_t *audio_buffer;
+static int ab_size; // number of slots -- a power of 2 because of the way BUFIDX(seqno) works
+static void *ab_arena;
+static size_t ab_arena_size;
+static int ab_arena_locked;
+#define BUFIDX(seqno) ((seqno) & (ab_size-1))
+
+// handed to the player in place of a missing packet
+static abuf_t silent_frame;
+// if config.decode_on_play, packets are decoded into this as they are handed to the player
+static abuf_t decoded_frame;
+
+// variables shared between the threads -- use the __atomic builtins on them
+static uint64_t ab_read;  // written by the player: extended seqno of the next packet to play
+static uint64_t ab_write; // written by the receiver: extended seqno of the next packet expected
+static uint64_t ab_origin; // written by the receiver: extended seqno it synced to
+static uint32_t ab_synced_epoch; // written by the receiver: the flush epoch in which it synced to ab_origin
+static uint32_t ab_published; // count of packets put into the buffer, for the wakeup below
+static uint32_t player_events; // count of requests from other threads that the player should see to at once
+static uint32_t flush_epoch; // advanced to ask for a flush
+static uint32_t player_epoch; // written by the player: the flush epoch it has flushed for
 static uint32_t flush_rtp_timestamp;
 static uint64_t time_of_last_audio_packet;
+static uint64_t time_of_flush; // when the last flush was requested, until audio is played after it; otherwise 0
+static uint64_t ab_read_time; // written by the player: when the packet at ab_read should start to play, or 0 if not known
+
+// player-only variables
+static int ab_reading = 0; // the player has taken up ab_origin and is reading from ab_read
+static int ab_buffering = 1;
+static uint32_t first_packet_timestamp = 0;
 static int shutdown_requested;
+static int32_t applied_volume; // the software volume at the end of the last packet played
+static uint64_t time_of_first_output; // when the first frames were sent to the output after the last flush
+static softvol_dither dither;
+#ifdef HAVE_LIBSOXR
+static soxr_t resampler = NULL;
+static double resampler_stuff; // the correction the ratio is currently set for, in frames per packet
+static uint64_t resampler_cpu_time, resampler_frames; // nanoseconds of CPU time and frames processed, for the statistics
+#endif
 
-// mutexes and condition variables
-static pthread_mutex_t ab_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+// the one blocking primitive: the player sleeps on flowcontrol until the exact time it next has something to do,
+// unless it's woken before then by a control event or, if it's waiting for one, a packet -- but it's only signalled if it's actually asleep
+static pthread_mutex_t flowcontrol_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t flowcontrol;
+static int player_sleeping; // 0 if awake, PLAYER_SLEEPING if asleep, PLAYER_SLEEPING_FOR_PACKET if a packet will wake it too
+#define PLAYER_SLEEPING 1
+#define PLAYER_SLEEPING_FOR_PACKET 2
+// the longest the player sleeps, even with nothing to do -- a request to disconnect from the output comes from a signal handler, which can't wake it
+#define PLAYER_MAX_SLEEP ((uint64_t)1<<32)
 
 static int64_t first_packet_time_to_play; // nanoseconds
 
 // stats
-static uint64_t missing_packets,late_packets,too_late_packets,resend_requests; 
+static uint64_t missing_packets,late_packets,too_late_packets;
+static uint64_t resends_requested,resends_recovered,resends_abandoned; // packets, not requests
+// with statistics on, the longest time the receiver took to put a packet into the buffer -- during which the
+// player is never held up -- and the longest the player took to wake for a packet it was waiting for, in fixed point
+static uint64_t ab_put_max, ab_wake_max;
+static uint64_t ab_wake_time; // written by the receiver: when it last woke the player for a packet, or 0
+
+static inline int ab_slot_ready(uint64_t xseqno) {
+  return __atomic_load_n(&audio_buffer[BUFIDX(xseqno)].ready,__ATOMIC_ACQUIRE)==xseqno;
+}
 
-static void ab_resync(void) {
-  int i;
-  for (i=0; i<BUFFER_FRAMES; i++) {
-    audio_buffer[i].ready = 0;
-    audio_buffer[i].sequence_number = 0;
-  }
-  ab_synced = 0;
+// A flush is a new epoch. Asking for one is just a matter of advancing flush_epoch, whatever is in the buffer.
+// When the player sees it, it flushes the output, stops reading from the buffer and moves into the new epoch itself;
+// then the receiver, seeing that, syncs afresh with the next packet, to extended seqnos that have never been used
+// before -- so the slots don't need clearing: what's left in them from before is simply never asked for again.
+
+// called from the player thread: stop reading from the buffer until the receiver syncs in the given epoch
+static void ab_resync(uint32_t epoch) {
+  ab_reading = 0;
   last_seqno_read = -1;
   ab_buffering = 1;
+#ifdef HAVE_LIBSOXR
+  if (resampler) { // don't let the end of the old audio out into the new, and start again at the nominal rate
+    soxr_clear(resampler);
+    soxr_set_io_ratio(resampler,1.0,0);
+    resampler_stuff = 0;
+  }
+#endif
+  __atomic_store_n(&ab_read_time,0,__ATOMIC_RELAXED);
+  __atomic_store_n(&player_epoch,epoch,__ATOMIC_RELEASE);
 }
 
-// the sequence number is a 16-bit unsigned number which wraps pretty often
-// to work out if one seqno is 'after' another therefore depends whether wrap has occurred
-// this function works out the actual ordinate of the seqno, i.e. the distance up from 
-// the zeroth element, at ab_read, taking due account of wrap.
-
-static inline seq_t SUCCESSOR(seq_t x) {
-  uint32_t p = x & 0xffff;
-  p+=1;
-  p = p & 0xffff;
-  return p;
+// called from the player thread: start reading from the receiver's sync point, if it has one in this epoch
+static void ab_take_up_sync(void) {
+  if ((ab_reading==0) && (__atomic_load_n(&ab_synced_epoch,__ATOMIC_ACQUIRE)==player_epoch)) {
+    __atomic_store_n(&ab_read,__atomic_load_n(&ab_origin,__ATOMIC_RELAXED),__ATOMIC_RELEASE);
+    ab_reading = 1;
+  }
 }
 
-static inline seq_t PREDECESSOR(seq_t x) {
-  uint32_t p = (x & 0xffff)+0x10000;
-  p-=1;
-  p = p & 0xffff;
-  return p;
+// called from the receiver thread after putting a packet in the buffer or syncing
+static void wake_player(void) {
+  __atomic_add_fetch(&ab_published,1,__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&player_sleeping,__ATOMIC_SEQ_CST)==PLAYER_SLEEPING_FOR_PACKET) {
+    if (config.statistics_requested)
+      __atomic_store_n(&ab_wake_time,get_absolute_time_in_fp(),__ATOMIC_RELAXED);
+    pthread_mutex_lock(&flowcontrol_mutex);
+    pthread_cond_signal(&flowcontrol);
+    pthread_mutex_unlock(&flowcontrol_mutex);
+  }
 }
 
-// anything with ORDINATE in it must be proctected by the ab_mutex
-static inline int32_t ORDINATE(seq_t x) {
-  int32_t p = x & 0xffff;
-  int32_t q = ab_read & 0x0ffff;
-  int32_t t = (p+0x10000-q) & 0xffff;
-  // we definitely will get a positive number in t at this point, but it might be a
-  // positive alias of a negative number, i.e. x might actually be "before" ab_read
-  // So, if the result is greater than 32767, we will assume its an
-  // alias and subtract 65536 from it
-  if (t >= 32767) {
-    // debug(1,"OOB: %u, ab_r: %u, ab_w: %u",x,ab_read,ab_write);
-    t -= 65536;
+// called from other threads, after making a request of the player
+static void wake_player_for_event(void) {
+  __atomic_add_fetch(&player_events,1,__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&player_sleeping,__ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&flowcontrol_mutex);
+    pthread_cond_signal(&flowcontrol);
+    pthread_mutex_unlock(&flowcontrol_mutex);
   }
-  return t;
 }
 
-// wrapped number between two seq_t.
-int32_t seq_diff(seq_t a, seq_t b) {
-    int32_t diff = ORDINATE(b) - ORDINATE(a);
-    return diff;
+// called from any thread
+static void flush_epoch_advance(void) {
+  __atomic_add_fetch(&flush_epoch,1,__ATOMIC_SEQ_CST);
+  wake_player_for_event();
 }
 
-// the sequence numbers will wrap pretty often.
-// this returns true if the second arg is after the first
-static inline int seq_order(seq_t a, seq_t b) {
-    int32_t d = ORDINATE(b) - ORDINATE(a);
-    return d > 0;
+// called from the player thread: sleep until time_of_wakeup_fp, or until a control event after player_events had the value events,
+// or, if for_packet is set, until a packet arrives after ab_published had the value published.
+// Returns non-zero if it was woken early.
+static int player_sleep(uint64_t time_now_fp, uint64_t time_of_wakeup_fp, int for_packet, uint32_t published, uint32_t events) {
+  pthread_mutex_lock(&flowcontrol_mutex);
+  __atomic_store_n(&player_sleeping,for_packet ? PLAYER_SLEEPING_FOR_PACKET : PLAYER_SLEEPING,__ATOMIC_SEQ_CST);
+  if ((!please_stop) && (time_of_wakeup_fp>time_now_fp) && (__atomic_load_n(&player_events,__ATOMIC_SEQ_CST)==events) &&
+      ((for_packet==0) || (__atomic_load_n(&ab_published,__ATOMIC_SEQ_CST)==published))) {
+#ifdef COMPILE_FOR_LINUX
+    uint64_t sec = time_of_wakeup_fp>>32;
+    uint64_t nsec = ((time_of_wakeup_fp&0xffffffff)*1000000000)>>32;
+
+    struct timespec time_of_wakeup;
+    time_of_wakeup.tv_sec = sec;
+    time_of_wakeup.tv_nsec = nsec;
+
+    pthread_cond_timedwait(&flowcontrol,&flowcontrol_mutex,&time_of_wakeup);
+#endif
+#ifdef COMPILE_FOR_OSX
+    uint64_t time_to_wait_for_wakeup_fp = time_of_wakeup_fp-time_now_fp;
+    uint64_t sec = time_to_wait_for_wakeup_fp>>32;
+    uint64_t nsec = ((time_to_wait_for_wakeup_fp&0xffffffff)*1000000000)>>32;
+    struct timespec time_to_wait;
+    time_to_wait.tv_sec = sec;
+    time_to_wait.tv_nsec = nsec;
+    pthread_cond_timedwait_relative_np(&flowcontrol,&flowcontrol_mutex,&time_to_wait);
+#endif
+  }
+  __atomic_store_n(&player_sleeping,0,__ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&flowcontrol_mutex);
+  return (please_stop) || (__atomic_load_n(&player_events,__ATOMIC_SEQ_CST)!=events) ||
+         ((for_packet) && (__atomic_load_n(&ab_published,__ATOMIC_SEQ_CST)!=published)) || (get_absolute_time_in_fp()<time_of_wakeup_fp);
 }
 
-static inline seq_t seq_sum(seq_t a, seq_t b) {
-  uint32_t p = a & 0xffff;
-  uint32_t q = b & 0x0ffff;
-  uint32_t r = (a+b) & 0xffff;
-  return r;
+// extend a 16-bit RTP sequence number to the 64-bit one nearest to reference
+static inline uint64_t seq_extend(seq_t seqno, uint64_t reference) {
+  int16_t d = (int16_t)(uint16_t)(seqno-(seq_t)reference);
+  return reference+d;
 }
 
+static inline seq_t SUCCESSOR(seq_t x) {
+  uint32_t p = x & 0xffff;
+  p+=1;
+  p = p & 0xffff;
+  return p;
+}
+
+// once the first audio after a flush goes to the output, report how long it took -- and how long it took
+// the output to get its first frames, which is most of it if the device has to be opened
+static void note_output(int audio) {
+  uint64_t flushed = __atomic_load_n(&time_of_flush,__ATOMIC_RELAXED);
+  if (flushed==0)
+    return;
+  uint64_t time_now = get_absolute_time_in_fp();
+  if (time_of_first_output==0)
+    time_of_first_output = time_now;
+  if ((audio) && (__atomic_compare_exchange_n(&time_of_flush,&flushed,0,0,__ATOMIC_RELAXED,__ATOMIC_RELAXED)))
+    debug(2,"Flush to first frame output: %.3f ms; to first audio: %.3f ms.",
+          ((time_of_first_output-flushed)*1000.0)/((uint64_t)1<<32),((time_now-flushed)*1000.0)/((uint64_t)1<<32));
+}
 
+// forget the flush boundary once the stream has gone past it -- unless a new one has been set in the meantime
+static inline void flush_boundary_passed(uint32_t boundary) {
+  __atomic_compare_exchange_n(&flush_rtp_timestamp,&boundary,0x7fffffff,0,__ATOMIC_RELAXED,__ATOMIC_RELAXED);
+}
 // now for 32-bit wrapping in timestamps
 
 // this returns true if the second arg is strictly after the first
@@ -224,27 +329,17 @@ static inline int seq32_order(uint32_t a, uint32_t b) {
 
 
 
+// decrypts the packet in place -- so buf is left holding the plain packet
 static void alac_decode(short *dest, uint8_t *buf, int len) {
-  unsigned char packet[MAX_PACKET];
-  unsigned char packetp[MAX_PACKET];
   assert(len<=MAX_PACKET);
 
-  unsigned char iv[16];
-  int aeslen = len & ~0xf;
-  memcpy(iv, aesiv, sizeof(iv));
-   
-#ifdef HAVE_LIBPOLARSSL
-  aes_crypt_cbc(&dctx,AES_DECRYPT,aeslen,iv,buf, packet);
-#endif
-#ifdef HAVE_LIBSSL
-  AES_cbc_encrypt(buf, packet, aeslen, &aes, iv, AES_DECRYPT);
-#endif
-
-  memcpy(packet+aeslen, buf+aeslen, len-aeslen);
+  // any part block at the end is not encrypted
+  if (encrypted)
+    aescbc_decrypt(&aes_key, aesiv, buf, len & ~0xf);
 
   int outsize;
 
-  alac_decode_frame(decoder_info, packet, dest, &outsize);
+  alac_decode_frame(decoder_info, buf, len, dest, &outsize);
 
   assert(outsize == FRAME_BYTES(frame_size));
 }
@@ -285,110 +380,345 @@ static void free_decoder(void) {
 
 static void init_buffer(void) {
   int i;
-  for (i=0; i<BUFFER_FRAMES; i++)
-    audio_buffer[i].data = malloc(OUTFRAME_BYTES(frame_size));
-  ab_resync();
+  // the buffer has to hold at least the packets waiting out the latency
+  int size = config.buffer_packets;
+  int latency_packets = config.latency/frame_size+BUFFER_MARGIN;
+  if (size<latency_packets) {
+    debug(1,"A buffer of %d packets is too small for a latency of %d frames -- using %d packets.",size,config.latency,latency_packets);
+    size = latency_packets;
+  }
+  if (size<config.buffer_start_fill)
+    size = config.buffer_start_fill;
+  ab_size = 16;
+  while (ab_size<size)
+    ab_size <<= 1;
+
+  // the slots, then the audio or the packet for each slot, then the silent and decoded frames,
+  // each starting on a cache line
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t slots_bytes = (ab_size*sizeof(abuf_t)+63) & ~(size_t)63;
+  size_t frame_bytes = (OUTFRAME_BYTES(frame_size)+63) & ~(size_t)63;
+  size_t slot_bytes = config.decode_on_play ? PAYLOAD_BYTES : frame_bytes;
+  ab_arena_size = (slots_bytes+ab_size*slot_bytes+2*frame_bytes+page_size-1) & ~(page_size-1);
+  if (posix_memalign(&ab_arena,page_size,ab_arena_size))
+    die("could not allocate %u bytes for the audio buffer",(unsigned int)ab_arena_size);
+  // touch every page now, so that the first pass around the ring doesn't page-fault
+  memset(ab_arena,0,ab_arena_size);
+  ab_arena_locked = 0;
+  if (config.lock_buffer) {
+    if (mlock(ab_arena,ab_arena_size)==0)
+      ab_arena_locked = 1;
+    else
+      warn("Could not lock the audio buffer into memory: %s.",strerror(errno));
+  }
+  debug(2,"Audio buffer of %d packets in %u bytes%s.",ab_size,(unsigned int)ab_arena_size,ab_arena_locked ? ", locked into memory" : "");
+
+  audio_buffer = ab_arena;
+  char *slot_space = (char*)ab_arena+slots_bytes;
+  for (i=0; i<ab_size; i++) {
+    if (config.decode_on_play) {
+      audio_buffer[i].payload = (uint8_t*)(slot_space+i*slot_bytes);
+      audio_buffer[i].capacity = PAYLOAD_BYTES;
+    } else {
+      audio_buffer[i].data = (signed short*)(slot_space+i*slot_bytes);
+    }
+  }
+  char *frames = slot_space+ab_size*slot_bytes;
+  silent_frame.data = (signed short*)frames;
+  silent_frame.timestamp = 0;
+  decoded_frame.data = (signed short*)(frames+frame_bytes);
+  ab_read = ab_write = ab_origin = 0;
+  uint32_t epoch = __atomic_load_n(&flush_epoch,__ATOMIC_ACQUIRE);
+  ab_synced_epoch = epoch-1; // so that the receiver syncs with the first packet
+  ab_resync(epoch);
 }
 
 static void free_buffer(void) {
   int i;
-  for (i=0; i<BUFFER_FRAMES; i++)
-    free(audio_buffer[i].data);
+  for (i=0; i<ab_size; i++)
+    if (audio_buffer[i].capacity>PAYLOAD_BYTES)
+      free(audio_buffer[i].payload);
+  if (ab_arena_locked)
+    munlock(ab_arena,ab_arena_size);
+  free(ab_arena);
+  ab_arena = 0;
+  audio_buffer = 0;
 }
 
+// Resend requests are made by the receiver. It keeps a list, in order, of the packets it has found missing and
+// not yet got. Those that are due are asked for together, in runs of adjacent packets. A packet that doesn't turn up
+// is asked for again after twice the round trip time to the client, then after twice as long again, and so on --
+// until it couldn't get here before it's due to be played, when it's given up.
+#define RESEND_LIST_SIZE 128
+#define RESEND_MAX_REQUESTS 5
+#define RESEND_DEFAULT_RTT (((uint64_t)1<<32)/50) // 20 ms, until it has been measured
+
+typedef struct resend {
+  uint64_t xseqno;
+  uint64_t time_of_request; // when it's next to be asked for
+  int requests; // how many times it's been asked for
+} resend_t;
+
+static resend_t resend_list[RESEND_LIST_SIZE];
+static int resend_count;
+
+// note that packets first to first+count-1 are missing, to be asked for straight away
+static void resend_add(uint64_t first, uint64_t count, uint64_t time_now) {
+  uint64_t i;
+  for (i=0; i<count; i++) {
+    if (resend_count==RESEND_LIST_SIZE) {
+      debug(2,"Too many packets missing to ask for them all -- giving up on %llu.",count-i);
+      resends_abandoned += count-i;
+      return;
+    }
+    resend_list[resend_count].xseqno = first+i;
+    resend_list[resend_count].time_of_request = time_now;
+    resend_list[resend_count].requests = 0;
+    resend_count++;
+  }
+}
+
+// a late packet has arrived -- if it was asked for, take it off the list
+static void resend_arrived(uint64_t xseqno) {
+  int i;
+  for (i=0; (i<resend_count) && (resend_list[i].xseqno<=xseqno); i++)
+    if (resend_list[i].xseqno==xseqno) {
+      memmove(resend_list+i,resend_list+i+1,(resend_count-i-1)*sizeof(resend_t));
+      resend_count--;
+      resends_recovered++;
+      return;
+    }
+}
+
+// ask for the packets that are due, and give up on those that can't be resent in time now
+static void resend_schedule(uint64_t time_now, uint64_t read) {
+  uint64_t rtt = rtp_round_trip_time();
+  if (rtt==0)
+    rtt = RESEND_DEFAULT_RTT;
+  uint64_t packet_time = ((uint64_t)frame_size<<32)/44100;
+  uint64_t read_time = __atomic_load_n(&ab_read_time,__ATOMIC_RELAXED);
+  if (read_time==0) // the player doesn't know yet when it will play the next packet, but it won't be for the latency
+    read_time = time_now+(((uint64_t)config.latency<<32)/44100);
+  else if (read_time<time_now)
+    read_time = time_now;
+  uint64_t run_first = 0, run_length = 0;
+  int i, kept = 0;
+  for (i=0; i<resend_count; i++) {
+    resend_t *r = resend_list+i;
+    int due = (r->time_of_request<=time_now);
+    if ((r->xseqno<read) || (read_time+(r->xseqno-read)*packet_time<time_now+rtt) ||
+        ((due) && (r->requests==RESEND_MAX_REQUESTS))) {
+      resends_abandoned++;
+      continue;
+    }
+    if (due) {
+      if ((run_length) && (r->xseqno==run_first+run_length)) {
+        run_length++;
+      } else {
+        if (run_length)
+          rtp_request_resend((seq_t)run_first,run_length);
+        run_first = r->xseqno;
+        run_length = 1;
+      }
+      uint64_t interval = (2*rtt)<<r->requests;
+      if (interval<packet_time)
+        interval = packet_time;
+      r->time_of_request = time_now+interval;
+      r->requests++;
+      resends_requested++;
+    }
+    resend_list[kept++] = *r;
+  }
+  if (run_length)
+    rtp_request_resend((seq_t)run_first,run_length);
+  resend_count = kept;
+}
+
+// called only from the RTP audio receiver thread -- the one producer for the audio buffer
 void player_put_packet(seq_t seqno,uint32_t timestamp, uint8_t *data, int len) {
-	
+
   packet_count++;
-  
-  pthread_mutex_lock(&ab_mutex);
-	time_of_last_audio_packet = get_absolute_time_in_fp();
-  if (connection_state_to_output) { // if we are supposed to be processing these packets
-  
-	  if ((flush_rtp_timestamp!=0x7fffffff) && ((timestamp==flush_rtp_timestamp) || seq32_order(timestamp,flush_rtp_timestamp))) {
-		  debug(2,"Dropping flushed packet in player_put_packet, seqno %u, timestamp %u, flushing to timestamp: %u.",seqno,timestamp,flush_rtp_timestamp);
-	  } else {
-		  if ((flush_rtp_timestamp!=0x7fffffff) && (!seq32_order(timestamp,flush_rtp_timestamp))) // if we have gone past the flush boundary time
-			  flush_rtp_timestamp=0x7fffffff;
-
-		  abuf_t *abuf = 0;
-
-		  if (!ab_synced) {
-			  debug(2, "syncing to seqno %u.", seqno);
-			  ab_write = seqno;
-			  ab_read = seqno;
-			  ab_synced = 1;
-		  }
-		  if (ab_write == seqno) {       // expected packet
-			  abuf = audio_buffer + BUFIDX(seqno);
-			  ab_write = SUCCESSOR(seqno);
-		  } else if (seq_order(ab_write, seqno)) {    // newer than expected
-			  //if (ORDINATE(seqno)>(BUFFER_FRAMES*7)/8)
-			  // debug(1,"An interval of %u frames has opened, with ab_read: %u, ab_write: %u and seqno: %u.",seq_diff(ab_read,seqno),ab_read,ab_write,seqno);
-			  int32_t gap = seq_diff(ab_write,PREDECESSOR(seqno))+1;
-			  if (gap<=0)
-				  debug(1,"Unexpected gap size: %d.",gap);
-			  int i;
-			  for (i=0;i<gap;i++) {
-				  abuf = audio_buffer + BUFIDX(seq_sum(ab_write,i));
-				  abuf->ready = 0; // to be sure, to be sure
-				  abuf->timestamp = 0;
-				  abuf->sequence_number = 0;
-			  }
-			  // debug(1,"N %d s %u.",seq_diff(ab_write,PREDECESSOR(seqno))+1,ab_write);
-			  abuf = audio_buffer + BUFIDX(seqno);
-			  rtp_request_resend(ab_write,gap);
-			  resend_requests++;
-			  ab_write = SUCCESSOR(seqno);
-		  } else if (seq_order(ab_read, seqno)) {     // late but not yet played
-			  late_packets++;
-			  abuf = audio_buffer + BUFIDX(seqno);
-		  } else {                                    // too late.
-			  too_late_packets++;
-			  /*
-			  if (!late_packet_message_sent) {
-				  debug(1, "too-late packet received: %u; ab_read: %u; ab_write: %u.", seqno, ab_read, ab_write);
-				  late_packet_message_sent=1;
-			  }
-			  */
-		  }
-		  // pthread_mutex_unlock(&ab_mutex);
-
-		  if (abuf) {
-			  alac_decode(abuf->data, data, len);
-			  abuf->ready = 1;
-			  abuf->timestamp = timestamp;
-			  abuf->sequence_number = seqno;
-		  }
-	
-		  // pthread_mutex_lock(&ab_mutex);
-	
-    }
-    int rc = pthread_cond_signal(&flowcontrol);
-    if (rc)
-      debug(1,"Error signalling flowcontrol.");
+  uint64_t time_now = get_absolute_time_in_fp();
+  __atomic_store_n(&time_of_last_audio_packet,time_now,__ATOMIC_RELAXED);
+  if (__atomic_load_n(&connection_state_to_output,__ATOMIC_RELAXED)) { // if we are supposed to be processing these packets
+
+    // the flush boundary is set before the flush epoch is advanced, so look at it after the player's epoch
+    uint32_t epoch = __atomic_load_n(&player_epoch,__ATOMIC_ACQUIRE);
+    uint32_t flush_to = __atomic_load_n(&flush_rtp_timestamp,__ATOMIC_ACQUIRE);
+    if ((flush_to!=0x7fffffff) && ((timestamp==flush_to) || seq32_order(timestamp,flush_to))) {
+      debug(2,"Dropping flushed packet in player_put_packet, seqno %u, timestamp %u, flushing to timestamp: %u.",seqno,timestamp,flush_to);
+    } else {
+      if (flush_to!=0x7fffffff) // if we have gone past the flush boundary time
+        flush_boundary_passed(flush_to);
+
+      uint64_t read = __atomic_load_n(&ab_read,__ATOMIC_ACQUIRE);
+      if (ab_synced_epoch!=epoch) {
+        // the player has flushed, and won't read from the buffer again until we sync --
+        // to an extended seqno above any used so far, so nothing left in the buffer can be mistaken for it
+        uint64_t used = ab_write>read ? ab_write : read;
+        uint64_t origin = (((used>>16)+1)<<16) | seqno;
+        debug(2, "syncing to seqno %u.", seqno);
+        __atomic_store_n(&ab_write,origin,__ATOMIC_RELEASE);
+        __atomic_store_n(&ab_origin,origin,__ATOMIC_RELAXED);
+        __atomic_store_n(&ab_synced_epoch,epoch,__ATOMIC_RELEASE);
+        resend_count = 0;
+      }
+      // until the player takes up the sync, ab_read is left over from before it
+      if (read<ab_origin)
+        read = ab_origin;
+
+      uint64_t xseqno = seq_extend(seqno,ab_write);
+      abuf_t *abuf = 0;
+      if (xseqno==ab_write) {       // expected packet
+        abuf = audio_buffer + BUFIDX(xseqno);
+        __atomic_store_n(&ab_write,xseqno+1,__ATOMIC_RELEASE);
+      } else if (xseqno>ab_write) {    // newer than expected
+        resend_add(ab_write,xseqno-ab_write,time_now);
+        abuf = audio_buffer + BUFIDX(xseqno);
+        __atomic_store_n(&ab_write,xseqno+1,__ATOMIC_RELEASE);
+      } else if (xseqno>=read) {     // late but not yet played
+        late_packets++;
+        abuf = audio_buffer + BUFIDX(xseqno);
+        if (__atomic_load_n(&abuf->ready,__ATOMIC_RELAXED)==xseqno)
+          abuf = 0; // we already have it -- a duplicate from a resend
+        else
+          resend_arrived(xseqno);
+      } else {                                    // too late.
+        too_late_packets++;
+      }
+      // the player may still be playing from the slot of the packet before ab_read
+      if ((abuf) && (xseqno+1>=read+ab_size)) {
+        debug(2,"Dropping packet seqno %u, which is too far ahead of the player to fit in the buffer.",seqno);
+        abuf = 0;
+      }
+
+      if (abuf) {
+        if (config.decode_on_play) {
+          assert(len<=MAX_PACKET);
+          if (len>abuf->capacity) {
+            uint8_t *payload = malloc(MAX_PACKET);
+            if (!payload)
+              die("could not allocate a packet buffer");
+            if (abuf->capacity>PAYLOAD_BYTES)
+              free(abuf->payload);
+            abuf->payload = payload;
+            abuf->capacity = MAX_PACKET;
+          }
+          memcpy(abuf->payload, data, len);
+          abuf->length = len;
+        } else {
+          alac_decode(abuf->data, data, len);
+        }
+        abuf->timestamp = timestamp;
+        abuf->sequence_number = seqno;
+        __atomic_store_n(&abuf->ready,xseqno,__ATOMIC_RELEASE);
+        wake_player();
+        if (config.statistics_requested) {
+          uint64_t put = get_absolute_time_in_fp()-time_now;
+          if (put>__atomic_load_n(&ab_put_max,__ATOMIC_RELAXED))
+            __atomic_store_n(&ab_put_max,put,__ATOMIC_RELAXED);
+        }
+      }
+      if (resend_count)
+        resend_schedule(time_now,read);
     }
-  pthread_mutex_unlock(&ab_mutex);
+  }
 }
 
+// called from the player thread: apply the software volume to frames frames, ramping to a new setting if there is one
+static void apply_volume(short *outptr, short *inptr, int frames) {
+  int32_t target = __atomic_load_n(&fix_volume,__ATOMIC_RELAXED);
+  softvol_apply(&dither,outptr,inptr,frames,applied_volume,target);
+  applied_volume = target;
+}
 
-static inline short lcg_rand(void) {
-  static unsigned long lcg_prev = 12345;
-  lcg_prev = lcg_prev * 69069 + 3;
-  return lcg_prev & 0xffff;
+static inline int volume_is_unity(void) {
+  return (applied_volume==SOFTVOL_UNITY) && (__atomic_load_n(&fix_volume,__ATOMIC_RELAXED)==SOFTVOL_UNITY);
 }
 
-static inline short dithered_vol(short sample) {
-  short rand_a, rand_b;
-  long out;
+// With --output-batch, the output of packets that are ready one after the other is gathered up in batch
+// and handed to the output device in one write, so that the player writes to it, asks it for its delay and
+// waits for it once a batch rather than once a packet. A batch is as many packets as take the DAC queue from
+// just over its minimum length -- below which no stuffing is done -- to its desired length, so the player
+// only goes for one once the queue has come down that far.
+static int batch_size = 1; // packets -- one unless config.output_batch
+static short *batch;
+static int batch_room; // frames
+static int batch_fill; // frames in the batch so far
+static int batch_count; // packets in the batch so far
+static int64_t batch_delay; // the DAC delay when it was last asked for, at batch_time, less the frames in the batch then
+static uint64_t batch_time; // zero if it hasn't been asked for since the last batch was written
+
+// the DAC queue length the player waits for before getting more packets
+static inline int32_t dac_low_water(void) {
+  return DAC_BUFFER_QUEUE_DESIRED_LENGTH-(batch_size-1)*frame_size;
+}
 
-  out = (long)sample * fix_volume;
-  if (fix_volume < 0x10000) {
-    rand_b = rand_a;
-    rand_a = lcg_rand();
-    out += rand_a;
-    out -= rand_b;
+// somewhere for the output of a packet, of up to frames frames: the next part of the batch, if batching,
+// or else the output device's own buffer if it lets us, or else fallback
+static short *output_begin(short *fallback, int frames, int *direct) {
+  short *ptr;
+  *direct = 0;
+  if (batch_size>1)
+    return batch+2*batch_fill;
+  if ((config.output->begin_write) && (config.output->begin_write(&ptr,frames)==0)) {
+    *direct = 1;
+    return ptr;
+  }
+  return fallback;
+}
+
+// frames frames of output, from output_begin, are ready
+static void output_end(short *ptr, int frames, int direct) {
+  if (batch_size>1) {
+    batch_fill += frames;
+    batch_count++;
+  } else if (direct)
+    config.output->commit(frames);
+  else
+    config.output->play(ptr, frames);
+}
+
+static void output_copy(short *buf, int frames) {
+  if (batch_size>1) {
+    memcpy(batch+2*batch_fill, buf, FRAME_BYTES(frames));
+    output_end(NULL, frames, 0);
+  } else
+    config.output->play(buf, frames);
+}
+
+static inline int batch_is_full(void) {
+  return (batch_count>=batch_size) || (batch_room-batch_fill<2*frame_size);
+}
+
+static void output_batch_write(void) {
+  if (batch_fill)
+    config.output->play(batch, batch_fill);
+  batch_fill = batch_count = 0;
+  batch_time = 0;
+}
+
+// take the packet at ab_read -- or a silent frame in its place if it's missing -- and move on
+static abuf_t *buffer_take_frame(void) {
+  abuf_t *curframe;
+  if (ab_slot_ready(ab_read)) {
+    curframe = audio_buffer + BUFIDX(ab_read);
+    if (config.decode_on_play) {
+      // only now that it's going to be played is the packet decrypted and decoded --
+      // packets that are flushed or arrive too late are never decoded at all
+      alac_decode(decoded_frame.data, curframe->payload, curframe->length);
+      decoded_frame.timestamp = curframe->timestamp;
+      decoded_frame.sequence_number = curframe->sequence_number;
+      curframe = &decoded_frame;
+    }
+  } else {
+    // debug(1, "    %d. Supplying a silent frame.", read);
+    missing_packets++;
+    curframe = &silent_frame;
   }
-  return out>>16;
+  // the receiver won't reuse curframe's slot until ab_read has moved on by another ab_size-1
+  __atomic_store_n(&ab_read,ab_read+1,__ATOMIC_RELEASE);
+  return curframe;
 }
 
 // get the next frame, when available. return 0 if underrun/stream reset.
@@ -396,95 +726,74 @@ static abuf_t *buffer_get_frame(void) {
   int16_t buf_fill;
   uint64_t local_time_now;
   // struct timespec tn;
-  abuf_t *abuf = 0;
-  int i;
-  abuf_t *curframe;
+  abuf_t *curframe = 0;
   
-  pthread_mutex_lock(&ab_mutex);
   int wait;
   int32_t dac_delay = 0;
+  int dac_has_room = 0; // if the player has slept until the DAC queue would come down far enough, so it needn't ask
   do {
+    // note how many packets have been put in the buffer and requests made, so as not to sleep through a new one
+    uint32_t published = __atomic_load_n(&ab_published,__ATOMIC_SEQ_CST);
+    uint32_t events = __atomic_load_n(&player_events,__ATOMIC_SEQ_CST);
+    int frame_ready = 0;
     // get the time
     local_time_now = get_absolute_time_in_fp();    
+    // when there'll next be something to do, if nothing turns up before then
+    uint64_t time_of_wakeup = local_time_now+PLAYER_MAX_SLEEP;
 
     // if config.timeout (default 120) seconds have elapsed since the last audio packet was received, then we should stop.
     // config.timeout of zero means don't check..., but iTunes may be confused by a long gap followed by a resumption...
-    if ((time_of_last_audio_packet!=0) && (shutdown_requested==0) && (config.timeout!=0)) {
+    uint64_t time_of_last_packet = __atomic_load_n(&time_of_last_audio_packet,__ATOMIC_RELAXED);
+    if ((time_of_last_packet!=0) && (shutdown_requested==0) && (config.timeout!=0)) {
     	uint64_t ct = config.timeout; // go from int to 64-bit int
-      if (local_time_now-time_of_last_audio_packet>=ct<<32) {
+      if (local_time_now-time_of_last_packet>=ct<<32) {
         debug(1,"As Yeats almost said, \"Too long a silence / can make a stone of the heart\"");
         rtsp_request_shutdown_stream();
         shutdown_requested=1;
+      } else if (time_of_last_packet+(ct<<32)<time_of_wakeup) {
+        time_of_wakeup = time_of_last_packet+(ct<<32);
       }
     }
     int rco = get_requested_connection_state_to_output();
     
     if (connection_state_to_output != rco) {
-      connection_state_to_output=rco;
+      __atomic_store_n(&connection_state_to_output,rco,__ATOMIC_RELAXED);
       // change happening
       if (connection_state_to_output==0) { //going off
-         pthread_mutex_lock(&flush_mutex);
-         flush_requested=1;
-         pthread_mutex_unlock(&flush_mutex);
+        flush_epoch_advance();
       }
     }
       
-    pthread_mutex_lock(&flush_mutex);
-    if (flush_requested==1) {
+    uint32_t epoch = __atomic_load_n(&flush_epoch,__ATOMIC_ACQUIRE);
+    if (epoch!=player_epoch) {
       if (config.output->flush)
         config.output->flush();
-      ab_resync();
+      uint64_t flushed = __atomic_load_n(&time_of_flush,__ATOMIC_RELAXED);
+      if (flushed)
+        debug(2,"Flush to quiet output: %.3f ms.",((get_absolute_time_in_fp()-flushed)*1000.0)/((uint64_t)1<<32));
+      time_of_first_output = 0;
+      // packets up to the flush boundary are dropped as they arrive, so none of them get into the new epoch
+      ab_resync(epoch);
       first_packet_timestamp = 0;
       first_packet_time_to_play = 0;
-      flush_requested=0;
     }
-    pthread_mutex_unlock(&flush_mutex);
-    uint32_t flush_limit = 0;
-    if (ab_synced) {
-    	do {
-    		curframe = audio_buffer + BUFIDX(ab_read);
-    		if (curframe->ready) {
-    		
-					if (curframe->sequence_number!=ab_read) {
-						// some kind of sync problem has occurred.
-						if (BUFIDX(curframe->sequence_number)==BUFIDX(ab_read)) {
-							// it looks like some kind of aliasing has happened
-							if (seq_order(ab_read,curframe->sequence_number)) {
-								ab_read=curframe->sequence_number;
-								debug(1,"Aliasing of buffer index -- reset.");
-							}
-						} else {
-							debug(1,"Inconsistent sequence numbers detected");
-						}
-					}
-    		    		
-					if ((flush_rtp_timestamp!=0x7fffffff) && ((curframe->timestamp==flush_rtp_timestamp) || seq32_order(curframe->timestamp,flush_rtp_timestamp))) {
-						debug(1,"Dropping flushed packet seqno %u, timestamp %u",curframe->sequence_number,curframe->timestamp);
-						curframe->ready=0;
-						flush_limit++;
-						ab_read=SUCCESSOR(ab_read);
-					}
-					if ((flush_rtp_timestamp!=0x7fffffff) && (!seq32_order(curframe->timestamp,flush_rtp_timestamp))) // if we have gone past the flush boundary time
-						flush_rtp_timestamp=0x7fffffff;
-				}
-    	} while ((flush_rtp_timestamp!=0x7fffffff) && (flush_limit<=8820) && (curframe->ready==0));
-    	
-    	if (flush_limit==8820) {
-    		debug(1,"Flush hit the 8820 frame limit!");
-    		flush_limit=0;
-    	}
-    	    
+    ab_take_up_sync();
+    if (ab_reading) {
       dac_delay = 0;
       curframe = audio_buffer + BUFIDX(ab_read);
-      if (config.output->delay) {
-        dac_delay = config.output->delay();
+      frame_ready = ab_slot_ready(ab_read);
+      if (dac_has_room) {
+        dac_delay = dac_low_water()-1;
+      } else if ((config.output->delay_at) || (config.output->delay)) {
+        dac_delay = config.output->delay_at ? config.output->delay_at(local_time_now) : config.output->delay();
         if (dac_delay==-1) {
           debug(1,"Error getting dac_delay at start of loop.");
           dac_delay=0;
         }
       }
+      dac_has_room = 0;
 
-      if (curframe->ready) {
+      if (frame_ready) {
 /*
 				// This is broken -- it causes infinite loops. It's in the wrong place, and anyway isn't used much.
         if ((flush_rtp_timestamp) && (flush_rtp_timestamp>=curframe->timestamp)) {
@@ -513,6 +822,7 @@ static abuf_t *buffer_get_frame(void) {
               int64_t delta = ((int64_t)first_packet_timestamp-(int64_t)reference_timestamp);
 
               first_packet_time_to_play = reference_timestamp_time+((delta+(int64_t)config.latency)<<32)/44100; // using the latency requested...
+              __atomic_store_n(&ab_read_time,first_packet_time_to_play,__ATOMIC_RELAXED);
               if (local_time_now>=first_packet_time_to_play) {
                 debug(2,"First packet is late! It should have played before now. Flushing 0.1 seconds");
                 player_flush(first_packet_timestamp+4410);
@@ -530,109 +840,93 @@ static abuf_t *buffer_get_frame(void) {
             if (local_time_now>=first_packet_time_to_play) {
               // we've gone past the time...
               // debug(1,"Run past the exact start time by %llu frames, with time now of %llx, fpttp of %llx and dac_delay of %d and %d packets; flush.",(((tn-first_packet_time_to_play)*44100)>>32)+dac_delay,tn,first_packet_time_to_play,dac_delay,seq_diff(ab_read, ab_write));
-            
-              if (config.output->flush)
-                config.output->flush();
-              ab_resync();
-              first_packet_timestamp = 0;
-              first_packet_time_to_play = 0;
+              flush_epoch_advance();
             } else {
               uint64_t gross_frame_gap = ((first_packet_time_to_play-local_time_now)*44100)>>32;
               int64_t exact_frame_gap = gross_frame_gap-dac_delay;
               if (exact_frame_gap<=0) {
                 // we've gone past the time...
                 // debug(1,"Run a bit past the exact start time by %lld frames, with time now of %llx, fpttp of %llx and dac_delay of %d and %d packets; flush.",-exact_frame_gap,tn,first_packet_time_to_play,dac_delay,seq_diff(ab_read, ab_write));
-                if (config.output->flush)
-                  config.output->flush();
-                ab_resync();
-                first_packet_timestamp = 0;
-                first_packet_time_to_play = 0;
+                flush_epoch_advance();
               } else {
-                uint32_t fs=filler_size;
-                if (fs>(max_dac_delay-dac_delay))
-                  fs=max_dac_delay-dac_delay;
-                if ((exact_frame_gap<=fs) || (exact_frame_gap<=frame_size*2)) {
-                  fs=exact_frame_gap;
-                  // debug(1,"Exact frame gap is %llu; play %d frames of silence. Dac_delay is %d, with %d packets, ab_read is %04x, ab_write is %04x.",exact_frame_gap,fs,dac_delay,seq_diff(ab_read, ab_write),ab_read,ab_write);
-                  ab_buffering = 0;
+                int scheduled = 0;
+                if ((config.output->start_at) && (dac_delay==0)) {
+                  // rather than fill the gap with silence, have the output start exactly on time, with the first
+                  // packets queued up in it -- once the gap is no more than the queue is to hold
+                  if (gross_frame_gap>max_dac_delay) {
+                    scheduled = 1; // not yet
+                    time_of_wakeup = first_packet_time_to_play-(((uint64_t)max_dac_delay<<32)/44100);
+                  } else if (config.output->start_at(first_packet_time_to_play)==0) {
+                    // debug(1,"Output to start in %llu frames.",gross_frame_gap);
+                    scheduled = 1;
+                    ab_buffering = 0;
+                  }
+                }
+                if (!scheduled) {
+                  uint32_t fs=filler_size;
+                  if (fs>(max_dac_delay-dac_delay))
+                    fs=max_dac_delay-dac_delay;
+                  if ((exact_frame_gap<=fs) || (exact_frame_gap<=frame_size*2)) {
+                    fs=exact_frame_gap;
+                    // debug(1,"Exact frame gap is %llu; play %d frames of silence. Dac_delay is %d, with %d packets, ab_read is %04x, ab_write is %04x.",exact_frame_gap,fs,dac_delay,seq_diff(ab_read, ab_write),ab_read,ab_write);
+                    ab_buffering = 0;
+                  }
+                  signed short *silence;
+                  silence = malloc(FRAME_BYTES(fs));
+                  memset(silence, 0, FRAME_BYTES(fs));
+                  // debug(1,"Exact frame gap is %llu; play %d frames of silence. Dac_delay is %d, with %d packets.",exact_frame_gap,fs,dac_delay,seq_diff(ab_read, ab_write));
+                  config.output->play(silence, fs);
+                  note_output(0);
+                  free(silence);
+                  // come back when there's room in the DAC queue for another packet's worth
+                  int32_t excess = dac_delay+fs-(DAC_BUFFER_QUEUE_DESIRED_LENGTH-frame_size);
+                  time_of_wakeup = local_time_now+(((uint64_t)(excess>0 ? excess : 1)<<32)/44100);
                 }
-                signed short *silence;
-                silence = malloc(FRAME_BYTES(fs));
-                memset(silence, 0, FRAME_BYTES(fs));
-                // debug(1,"Exact frame gap is %llu; play %d frames of silence. Dac_delay is %d, with %d packets.",exact_frame_gap,fs,dac_delay,seq_diff(ab_read, ab_write));
-                config.output->play(silence, fs);
-                free(silence);
               }
             }
           }
         }
       }
     }
-    wait = (ab_buffering || (dac_delay>=DAC_BUFFER_QUEUE_DESIRED_LENGTH) || (!ab_synced)) && (!please_stop);
+    wait = (ab_buffering || (dac_delay>=dac_low_water()) || (!ab_reading)) && (!please_stop);
 //    wait = (ab_buffering ||  (seq_diff(ab_read, ab_write) < (config.latency-22000)/(352)) || (!ab_synced)) && (!please_stop);
     if (wait) {
-      uint64_t time_to_wait_for_wakeup_fp = ((uint64_t)1<<32)/44100; // this is time period of one frame
-      time_to_wait_for_wakeup_fp *= 4*352; // four full 352-frame packets
-      time_to_wait_for_wakeup_fp /= 3;  //four thirds of a packet time 
-      
-#ifdef COMPILE_FOR_LINUX
-      uint64_t time_of_wakeup_fp = local_time_now+time_to_wait_for_wakeup_fp;
-      uint64_t sec = time_of_wakeup_fp>>32;
-      uint64_t nsec = ((time_of_wakeup_fp&0xffffffff)*1000000000)>>32;
-      
-      struct timespec time_of_wakeup;
-      time_of_wakeup.tv_sec = sec;
-      time_of_wakeup.tv_nsec = nsec;
-      
-      pthread_cond_timedwait(&flowcontrol,&ab_mutex,&time_of_wakeup);      
-      // int rc = pthread_cond_timedwait(&flowcontrol,&ab_mutex,&time_of_wakeup);
-      // if (rc!=0)
-      //  debug(1,"pthread_cond_timedwait returned error code %d.",rc);
-#endif
-#ifdef COMPILE_FOR_OSX
-      uint64_t sec = time_to_wait_for_wakeup_fp>>32;;
-      uint64_t nsec = ((time_to_wait_for_wakeup_fp&0xffffffff)*1000000000)>>32;
-      struct timespec time_to_wait;
-      time_to_wait.tv_sec = sec;
-      time_to_wait.tv_nsec = nsec;
-      pthread_cond_timedwait_relative_np(&flowcontrol,&ab_mutex,&time_to_wait);     
-#endif
+      int waiting_for_room = 0;
+      if ((!ab_buffering) && (ab_reading) && (dac_delay>=dac_low_water())) {
+        // the DAC queue will have come down far enough after this many frames
+        uint64_t time_of_room = local_time_now+(((uint64_t)(dac_delay-dac_low_water()+1)<<32)/44100);
+        if (time_of_room<=time_of_wakeup) {
+          time_of_wakeup = time_of_room;
+          waiting_for_room = 1;
+        }
+      }
+      // if it's a packet we're waiting for -- or a reference time, which comes with the packets -- let the receiver wake us when one arrives
+      int woken_early = player_sleep(local_time_now,time_of_wakeup,(!ab_reading) || (!frame_ready) || (first_packet_time_to_play==0),published,events);
+      uint64_t woken_for_packet = __atomic_exchange_n(&ab_wake_time,0,__ATOMIC_RELAXED);
+      if ((woken_early) && (woken_for_packet)) {
+        uint64_t wake = get_absolute_time_in_fp()-woken_for_packet;
+        if (wake>ab_wake_max)
+          ab_wake_max = wake;
+      }
+      dac_has_room = (waiting_for_room) && (!woken_early);
     }    
   } while (wait);
 
-  if (please_stop) {
-    pthread_mutex_unlock(&ab_mutex);
+  if (please_stop)
     return 0;
-  }
 
-  seq_t read = ab_read;
 
-  // check if t+8, t+16, t+32, t+64, t+128, ... (buffer_start_fill / 2)
-  // packets have arrived... last-chance resend
-  
-  
-  if (!ab_buffering) {
-    for (i = 8; i < (seq_diff(ab_read,ab_write) / 2); i = (i * 2)) {
-      seq_t next = seq_sum(ab_read,i);
-      abuf = audio_buffer + BUFIDX(next);
-      if (!abuf->ready) {
-        rtp_request_resend(next, 1);
-        // debug(1,"Resend %u.",next);
-        resend_requests++;
-      }
-    }
-  }
-  
-  if (!curframe->ready) {
-    // debug(1, "    %d. Supplying a silent frame.", read);
-    missing_packets++;
-    memset(curframe->data, 0, FRAME_BYTES(frame_size));
-    curframe->timestamp=0;    
-  }
-  curframe->ready = 0;
-  ab_read=SUCCESSOR(ab_read);
-  pthread_mutex_unlock(&ab_mutex);
-  return curframe;
+  // missing packets are asked for again, if need be, by the receiver -- see resend_schedule()
+  return buffer_take_frame();
+}
+
+// the next packet, if it's in the buffer and there's nothing else for buffer_get_frame() to see to first -- otherwise NULL
+static abuf_t *buffer_get_ready_frame(void) {
+  if ((please_stop) || (!ab_reading) || (ab_buffering) || (!ab_slot_ready(ab_read)) ||
+      (__atomic_load_n(&flush_epoch,__ATOMIC_ACQUIRE)!=player_epoch) ||
+      (get_requested_connection_state_to_output()!=connection_state_to_output))
+    return NULL;
+  return buffer_take_frame();
 }
 
 static inline short shortmean(short a, short b) {
@@ -646,119 +940,86 @@ static inline short shortmean(short a, short b) {
 }
 
 // stuff: 1 means add 1; 0 means do nothing; -1 means remove 1
+// The frame is inserted or deleted in inptr, which has room for the extra frame,
+// so that outptr -- which may be in the output device's own buffer -- is only written to, just once.
 static int stuff_buffer_basic(short *inptr, short *outptr, int stuff) {
     if ((stuff>1) || (stuff<-1)) {
       debug(1,"Stuff argument to stuff_buffer must be from -1 to +1.");
       return frame_size;
     }
-    int i;
     int stuffsamp = frame_size;
     if (stuff)
 //      stuffsamp = rand() % (frame_size - 1);
       stuffsamp = (rand() % (frame_size-2))+1; // ensure there's always a sample before and after the item
 
-    pthread_mutex_lock(&vol_mutex);
-    for (i=0; i<stuffsamp; i++) {   // the whole frame, if no stuffing
-        *outptr++ = dithered_vol(*inptr++);
-        *outptr++ = dithered_vol(*inptr++);
-    };
-    if (stuff) {
-        if (stuff==1) {
-            debug(3, "+++++++++");
-            // interpolate one sample
-            //*outptr++ = dithered_vol(((long)inptr[-2] + (long)inptr[0]) >> 1);
-            //*outptr++ = dithered_vol(((long)inptr[-1] + (long)inptr[1]) >> 1);
-            *outptr++ = dithered_vol(shortmean(inptr[-2],inptr[0]));
-            *outptr++ = dithered_vol(shortmean(inptr[-1],inptr[1]));
-        } else if (stuff==-1) {
-            debug(3, "---------");
-            inptr++;
-            inptr++;
-        }
-        for (i=stuffsamp; i<frame_size + stuff; i++) {
-            *outptr++ = dithered_vol(*inptr++);
-            *outptr++ = dithered_vol(*inptr++);
-        }
+    short *ip = inptr+2*stuffsamp;
+    if (stuff==1) {
+        debug(3, "+++++++++");
+        // interpolate one sample
+        memmove(ip+2,ip,FRAME_BYTES(frame_size-stuffsamp));
+        ip[0] = shortmean(ip[-2],ip[2]);
+        ip[1] = shortmean(ip[-1],ip[3]);
+    } else if (stuff==-1) {
+        debug(3, "---------");
+        memmove(ip,ip+2,FRAME_BYTES(frame_size-stuffsamp-1));
     }
-    pthread_mutex_unlock(&vol_mutex);
+    apply_volume(outptr,inptr,frame_size + stuff);
 
     return frame_size + stuff;
 }
 
 #ifdef HAVE_LIBSOXR
-// stuff: 1 means add 1; 0 means do nothing; -1 means remove 1
-static int stuff_buffer_soxr(short *inptr, short *outptr, int stuff) {
+// With -S soxr, every packet goes through one variable-rate resampler that lasts for the whole session,
+// so a correction is a small, slewed change in its ratio rather than a packet resampled on its own.
+// The resampler holds back some audio, which is counted in with the DAC delay.
+static void resampler_open(void) {
+  soxr_error_t error;
+  soxr_io_spec_t io_spec = soxr_io_spec(SOXR_INT16_I,SOXR_INT16_I);
+  soxr_quality_spec_t q_spec = soxr_quality_spec(SOXR_HQ,SOXR_VR);
+  // for variable-rate resampling, the rates given are the largest input to output ratio that will be used
+  resampler = soxr_create(2.0,1.0,2,&error,&io_spec,&q_spec,NULL);
+  if (error)
+    die("soxr error: %s", soxr_strerror(error));
+  soxr_set_io_ratio(resampler,1.0,0);
+  resampler_stuff = 0;
+  resampler_cpu_time = resampler_frames = 0;
+}
+
+static void resampler_close(void) {
+  soxr_delete(resampler);
+  resampler = NULL;
+}
+
+// stuff: frames to add (if positive) or remove (if negative) per packet, from -1 to +1 -- not necessarily a whole number
+// The frames come out of the resampler some time after they go in, so the number returned varies a little.
+static int stuff_buffer_soxr(short *inptr, short *outptr, double stuff) {
   if ((stuff>1) || (stuff<-1)) {
     debug(1,"Stuff argument to sox_stuff_buffer must be from -1 to +1.");
-    return frame_size;
+    stuff = 0;
   }
-  int i;
-  short *ip,*op;
-  ip=inptr;
-  op=outptr;
-  
-  if (stuff) {
-    // debug(1,"Stuff %d.",stuff);
-    soxr_io_spec_t io_spec;
-    io_spec.itype = SOXR_INT16_I;
-    io_spec.otype = SOXR_INT16_I;
-    io_spec.scale = 1.0; // this seems to crash if not = 1.0
-    io_spec.e = NULL;
-    io_spec.flags = 0;
-
-    size_t odone;
-
-    soxr_error_t error = soxr_oneshot(frame_size, frame_size + stuff, 2, /* Rates and # of chans. */
-      inptr, frame_size, NULL, /* Input. */
-      outptr, frame_size + stuff, &odone, /* Output. */
-      &io_spec, /* Input, output and transfer spec. */
-      NULL, NULL); /* Default configuration.*/
-
-    if (error)
-      die("soxr error: %s\n", "error: %s\n", soxr_strerror(error));
-
-    if (odone > frame_size + 1)
-      die("odone = %d!\n", odone);
-
-    const int gpm = 5;
-    
-    // keep the first (dpm) samples, to mitigate the Gibbs phenomenon
-    for (i=0;i<gpm;i++) {
-      *op++ = *ip++;
-      *op++ = *ip++;
-    }
+  struct timespec cpu_start,cpu_end;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID,&cpu_start);
 
-    // keep the last (dpm) samples, to mitigate the Gibbs phenomenon
-    op=outptr+(frame_size+stuff-gpm)*sizeof(short);
-    ip=inptr+(frame_size-gpm)*sizeof(short);
-    for (i=0;i<gpm;i++) {
-      *op++ = *ip++;
-      *op++ = *ip++;
-    }
-
-    // finally, adjust the volume, if necessary
-    if (volume!=1.0) {
-      // pthread_mutex_lock(&vol_mutex);
-      op=outptr;
-      for (i=0; i<frame_size+stuff; i++) {
-        *op = dithered_vol(*op);
-        op++;
-        *op = dithered_vol(*op);
-        op++;
-      };
-      // pthread_mutex_unlock(&vol_mutex);
-    }
-    
-  } else { // the whole frame, if no stuffing
-  
-    // pthread_mutex_lock(&vol_mutex);
-    for (i=0; i<frame_size; i++) {   
-      *op++ = dithered_vol(*ip++);
-      *op++ = dithered_vol(*ip++);
-    };
-    // pthread_mutex_unlock(&vol_mutex);
+  if (stuff!=resampler_stuff) { // move to the new ratio over the course of this packet
+    soxr_set_io_ratio(resampler,(double)frame_size/(frame_size+stuff),frame_size);
+    resampler_stuff = stuff;
   }
-  return frame_size + stuff;
+
+  size_t idone,odone;
+  // outptr has room for two packets
+  soxr_error_t error = soxr_process(resampler,inptr,frame_size,&idone,outptr,2*frame_size,&odone);
+  if (error)
+    die("soxr error: %s", soxr_strerror(error));
+  if (idone!=frame_size)
+    debug(1,"The resampler took only %u of %u frames.",(unsigned int)idone,frame_size);
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID,&cpu_end);
+  resampler_cpu_time += (cpu_end.tv_sec-cpu_start.tv_sec)*(uint64_t)1000000000+cpu_end.tv_nsec-cpu_start.tv_nsec;
+  resampler_frames += frame_size;
+
+  // finally, adjust the volume, if necessary
+  apply_volume(outptr,outptr,odone);
+  return odone;
 }
 #endif
 
@@ -766,8 +1027,68 @@ typedef struct stats { // statistics for running averages
   int64_t sync_error,correction,drift;
 } stats_t;
 
+// With --sync-mode=pll, the sync error of each packet -- the sample that goes into the statistics -- is fed
+// into a proportional-integral loop. The integral term converges on the rate difference between the source
+// and the DAC, and the correction is applied continuously: as an exactly varying ratio by the resampler,
+// or otherwise by inserting or deleting single frames at evenly spaced intervals.
+// The gains make the loop critically damped, with a time constant of about 8 seconds.
+#define SYNC_LOOP_FILTER (1.0/16) // low-pass filter for the jitter in the sync error
+#define SYNC_LOOP_KP (1.0/512)
+#define SYNC_LOOP_KI (SYNC_LOOP_KP*SYNC_LOOP_KP/4)
+#define SYNC_LOOP_LIMIT_PPM 1000 // the greatest correction that will be made
+
+typedef struct sync_loop { // all in frames, or frames per packet
+  double error; // filtered sync error
+  double drift; // integral term: the estimated rate difference
+  double correction; // frames to add (if positive) or remove (if negative) per packet
+  double owed; // correction not yet made in whole frames
+  int started;
+} sync_loop_t;
+
+static void sync_loop_update(sync_loop_t *loop, int64_t sync_error) {
+  double limit = frame_size*SYNC_LOOP_LIMIT_PPM*1e-6;
+  if (loop->started)
+    loop->error += SYNC_LOOP_FILTER*(sync_error-loop->error);
+  else {
+    loop->error = sync_error;
+    loop->started = 1;
+  }
+  // a positive sync error means the audio is late, so frames have to be removed
+  loop->drift -= SYNC_LOOP_KI*loop->error;
+  if (loop->drift>limit)
+    loop->drift = limit;
+  if (loop->drift<-limit)
+    loop->drift = -limit;
+  loop->correction = loop->drift-SYNC_LOOP_KP*loop->error;
+  if (loop->correction>limit)
+    loop->correction = limit;
+  if (loop->correction<-limit)
+    loop->correction = -limit;
+}
+
+// the whole frames to insert (+1) or delete (-1) in this packet to make the correction, if any
+static int sync_loop_stuff(sync_loop_t *loop) {
+  loop->owed += loop->correction;
+  if (loop->owed>=1.0) {
+    loop->owed -= 1.0;
+    return 1;
+  }
+  if (loop->owed<=-1.0) {
+    loop->owed += 1.0;
+    return -1;
+  }
+  return 0;
+}
+
+// a new stream after a flush: forget its error, but keep the drift, which belongs to the source and the DAC
+static void sync_loop_restart(sync_loop_t *loop) {
+  loop->error = 0.0;
+  loop->owed = 0.0;
+  loop->started = 0;
+}
+
 static void *player_thread_func(void *arg) {
-  connection_state_to_output = get_requested_connection_state_to_output();
+  __atomic_store_n(&connection_state_to_output,get_requested_connection_state_to_output(),__ATOMIC_RELAXED);
 //this is about half a minute
 #define trend_interval 3758
   stats_t statistics[trend_interval];
@@ -775,13 +1096,13 @@ static void *player_thread_func(void *arg) {
   int64_t tsum_of_sync_errors,tsum_of_corrections,tsum_of_insertions_and_deletions,tsum_of_drifts;
   int64_t previous_sync_error,previous_correction;
   int64_t minimum_dac_queue_size = 1000000;
-  int32_t minimum_buffer_occupancy = BUFFER_FRAMES;
+  int32_t minimum_buffer_occupancy = ab_size;
   int32_t maximum_buffer_occupancy = 0;
   
   int play_samples;
   int64_t current_delay;
   int play_number = 0;
-  time_of_last_audio_packet = 0;
+  __atomic_store_n(&time_of_last_audio_packet,0,__ATOMIC_RELAXED);
   shutdown_requested = 0;
   number_of_statistics = oldest_statistic = newest_statistic = 0;
   tsum_of_sync_errors = tsum_of_corrections = tsum_of_insertions_and_deletions = tsum_of_drifts = 0;
@@ -791,18 +1112,55 @@ static void *player_thread_func(void *arg) {
   
   char  rnstate[256];
   initstate(time(NULL),rnstate,256);
+  softvol_dither_init(&dither);
+  applied_volume = __atomic_load_n(&fix_volume,__ATOMIC_RELAXED);
   
   signed short *inbuf, *outbuf, *silence;
-  outbuf = malloc(OUTFRAME_BYTES(frame_size));
+  outbuf = malloc(OUTFRAME_BYTES(2*frame_size)); // the resampler can deliver more than a packet at a time
   silence = malloc(OUTFRAME_BYTES(frame_size));
   memset(silence, 0, OUTFRAME_BYTES(frame_size));
+  if (config.output_batch) {
+    batch_size = (DAC_BUFFER_QUEUE_DESIRED_LENGTH-DAC_BUFFER_QUEUE_MINIMUM_LENGTH)/frame_size+1;
+    batch_room = (batch_size+1)*frame_size; // the resampler's output varies a little
+    batch = malloc(FRAME_BYTES(batch_room));
+    debug(2,"Output in batches of up to %d packets.",batch_size);
+  } else {
+    batch_size = 1;
+  }
+  batch_fill = batch_count = 0;
+  batch_time = 0;
+
+  int resampling = 0; // if so, all the audio has to go through the resampler, to stay in order
+#ifdef HAVE_LIBSOXR
+  if (config.packet_stuffing==ST_soxr) {
+    resampler_open();
+    resampling = 1;
+  }
+#endif
 
   late_packet_message_sent=0;
-  missing_packets=late_packets=too_late_packets=resend_requests=0;
-  flush_rtp_timestamp=0x7fffffff; // it seems this number has a special significance -- it seems to be used as a null operand, so we'll use it like that too
+  missing_packets=late_packets=too_late_packets=0;
+  resends_requested=resends_recovered=resends_abandoned=0;
+  __atomic_store_n(&flush_rtp_timestamp,0x7fffffff,__ATOMIC_RELEASE); // it seems this number has a special significance -- it seems to be used as a null operand, so we'll use it like that too
   int sync_error_out_of_bounds = 0; // number of times in a row that there's been a serious sync error
+  sync_loop_t sync_loop;
+  memset(&sync_loop,0,sizeof(sync_loop));
+  uint32_t sync_loop_epoch = player_epoch;
   while (!please_stop) {
-    abuf_t *inframe = buffer_get_frame();
+    abuf_t *inframe = NULL;
+    if (batch_count) {
+      // carry on with the batch if the next packet is ready, otherwise write it before waiting for one
+      if (!batch_is_full())
+        inframe = buffer_get_ready_frame();
+      if (inframe==NULL)
+        output_batch_write();
+    }
+    if (inframe==NULL)
+      inframe = buffer_get_frame();
+    if (sync_loop_epoch!=player_epoch) {
+      sync_loop_restart(&sync_loop);
+      sync_loop_epoch = player_epoch;
+    }
     if (inframe) {
       inbuf = inframe->data;
       if (inbuf) {
@@ -811,7 +1169,14 @@ static void *player_thread_func(void *arg) {
         if (inframe->timestamp==0) {
           // debug(1,"Player has a supplied silent frame.");
           last_seqno_read = (SUCCESSOR(last_seqno_read)&0xffff); //manage the packet out of sequence minder
-          config.output->play(inbuf, frame_size);
+#ifdef HAVE_LIBSOXR
+          if (resampling) {
+            play_samples = stuff_buffer_soxr(inbuf, outbuf, resampler_stuff);
+            output_copy(outbuf, play_samples);
+          } else
+#endif
+          output_copy(inbuf, frame_size);
+          note_output(0);
         } else {
           // We have a frame of data. We need to see if we want to add or remove a frame from it to keep in sync.
           // So we calculate the timing error for the first frame in the DAC.
@@ -840,8 +1205,12 @@ static void *player_thread_func(void *arg) {
             td_in_frames = -((-td*44100)>>32);
           }
 
-          if (config.output->delay) {
-            current_delay = config.output->delay();
+          // the delay at local_time_now, exactly, if the output can tell
+          if (batch_time) {
+            // during a batch, it isn't asked for again: it's what it was, less what's been played since
+            current_delay = batch_delay-(int64_t)(((local_time_now-batch_time)*44100)>>32);
+          } else if ((config.output->delay_at) || (config.output->delay)) {
+            current_delay = config.output->delay_at ? config.output->delay_at(local_time_now) : config.output->delay();
             if (current_delay==-1) {
               debug(1,"Delay error when checking running latency.");
               current_delay=0;
@@ -849,10 +1218,24 @@ static void *player_thread_func(void *arg) {
           } else {
             current_delay = 0;
           }
+          if (batch_size>1) {
+            if (batch_time==0) {
+              batch_delay = current_delay;
+              batch_time = local_time_now;
+            }
+            current_delay += batch_fill; // not yet written
+          }
+#ifdef HAVE_LIBSOXR
+          if (resampling)
+            current_delay += (int64_t)soxr_delay(resampler);
+#endif
+          // this packet starts to play after current_delay frames, and the next one after it -- which the receiver needs to know to ask for resends
+          __atomic_store_n(&ab_read_time,local_time_now+(((uint64_t)((current_delay>0 ? current_delay : 0)+frame_size)<<32)/44100),__ATOMIC_RELAXED);
           if (current_delay<minimum_dac_queue_size)
             minimum_dac_queue_size=current_delay;
           
-          uint32_t bo = seq_diff(ab_read,ab_write);
+          int64_t occupancy = __atomic_load_n(&ab_write,__ATOMIC_ACQUIRE)-ab_read;
+          uint32_t bo = occupancy>0 ? occupancy : 0;
           
           if (bo<minimum_buffer_occupancy)
             minimum_buffer_occupancy=bo;
@@ -878,46 +1261,66 @@ static void *player_thread_func(void *arg) {
           }
           
           int amount_to_stuff = 0;
-          // require a certain error before bothering to fix it...
-          if (sync_error>config.tolerance) {
-            amount_to_stuff = -1;
-          }
-          if (sync_error<-config.tolerance) {
-            amount_to_stuff = 1;
-          }
+#ifdef HAVE_LIBSOXR
+          double correction = 0.0; // for the resampler, which needn't stick to whole frames
+#endif
+          if (config.sync_mode==SM_pll) {
+            sync_loop_update(&sync_loop,sync_error);
+            // only allow stuffing if there is enough time to do it -- check DAC buffer...
+            if (current_delay>=DAC_BUFFER_QUEUE_MINIMUM_LENGTH) {
+              amount_to_stuff = sync_loop_stuff(&sync_loop);
+#ifdef HAVE_LIBSOXR
+              correction = sync_loop.correction;
+#endif
+            }
+          } else {
+            // require a certain error before bothering to fix it...
+            if (sync_error>config.tolerance) {
+              amount_to_stuff = -1;
+            }
+            if (sync_error<-config.tolerance) {
+              amount_to_stuff = 1;
+            }
           
-          // only allow stuffing if there is enough time to do it -- check DAC buffer...
-          if (current_delay<DAC_BUFFER_QUEUE_MINIMUM_LENGTH) {
-            // debug(1,"DAC buffer too short to allow stuffing.");
-            amount_to_stuff=0;
-          }
-
-          // try to keep the corrections definitely below 1 in 1000 audio frames
-          if (amount_to_stuff) {
-            uint32_t x = random()%1000;
-            if (x>352)
+            // only allow stuffing if there is enough time to do it -- check DAC buffer...
+            if (current_delay<DAC_BUFFER_QUEUE_MINIMUM_LENGTH) {
+              // debug(1,"DAC buffer too short to allow stuffing.");
               amount_to_stuff=0;
+            }
+
+            // try to keep the corrections definitely below 1 in 1000 audio frames
+            if (amount_to_stuff) {
+              uint32_t x = random()%1000;
+              if (x>352)
+                amount_to_stuff=0;
+            }
+#ifdef HAVE_LIBSOXR
+            correction = amount_to_stuff;
+#endif
           }
             
-          if ((amount_to_stuff==0) && (fix_volume==0x10000)) {
+          if ((amount_to_stuff==0) && (volume_is_unity()) && (!resampling)) {
             // if no stuffing needed and no volume adjustment, then
-            // don't send to stuff_buffer_* and don't copy to outbuf; just send directly to the output device...
-            config.output->play(inbuf, frame_size);
+            // don't send to stuff_buffer_* and don't copy to outbuf; just send directly to the output device, or the batch...
+            output_copy(inbuf, frame_size);
           } else {
+            // if batching, write into the batch, or if the output device lets us, straight into its buffer rather than into outbuf
+            int direct;
+            short *outptr = output_begin(outbuf,resampling ? 2*frame_size : frame_size+amount_to_stuff,&direct);
 #ifdef HAVE_LIBSOXR
             switch (config.packet_stuffing) {
               case ST_basic:
 //                if (amount_to_stuff) debug(1,"Basic stuff...");
-                  play_samples = stuff_buffer_basic(inbuf, outbuf,amount_to_stuff);
+                  play_samples = stuff_buffer_basic(inbuf, outptr,amount_to_stuff);
                 break;
               case ST_soxr:
 //                if (amount_to_stuff) debug(1,"Soxr stuff...");
-                  play_samples = stuff_buffer_soxr(inbuf, outbuf,amount_to_stuff);
+                  play_samples = stuff_buffer_soxr(inbuf, outptr,correction);
                 break;
             }     
 #else
 //          if (amount_to_stuff) debug(1,"Standard stuff...");
-            play_samples = stuff_buffer_basic(inbuf, outbuf,amount_to_stuff);
+            play_samples = stuff_buffer_basic(inbuf, outptr,amount_to_stuff);
 #endif
 
       /*
@@ -935,8 +1338,9 @@ static void *player_thread_func(void *arg) {
       }
       */
 
-             config.output->play(outbuf, play_samples);
+            output_end(outptr, play_samples, direct);
           }
+          note_output(1);
           
           // check for loss of sync
           // timestamp of zero means an inserted silent frame in place of a missing frame
@@ -1000,16 +1404,33 @@ static void *player_thread_func(void *arg) {
           double moving_average_drift = (1.0*tsum_of_drifts)/number_of_statistics;
           // if ((play_number/print_interval)%20==0)
           if (config.statistics_requested)
-            inform("Sync error: %.1f (frames); net correction: %.1f (ppm); corrections: %.1f (ppm); missing packets %llu; late packets %llu; too late packets %llu; resend requests %llu; min DAC queue size %lli, min and max buffer occupancy %u and %u.", moving_average_sync_error, moving_average_correction*1000000/352, moving_average_insertions_plus_deletions*1000000/352,missing_packets,late_packets,too_late_packets,resend_requests,minimum_dac_queue_size,minimum_buffer_occupancy,maximum_buffer_occupancy);
+            inform("Sync error: %.1f (frames); net correction: %.1f (ppm); corrections: %.1f (ppm); missing packets %llu; late packets %llu; too late packets %llu; resends requested %llu, recovered %llu and abandoned %llu; min DAC queue size %lli, min and max buffer occupancy %u and %u.", moving_average_sync_error, moving_average_correction*1000000/352, moving_average_insertions_plus_deletions*1000000/352,missing_packets,late_packets,too_late_packets,resends_requested,resends_recovered,resends_abandoned,minimum_dac_queue_size,minimum_buffer_occupancy,maximum_buffer_occupancy);
+          if ((config.statistics_requested) && (config.sync_mode==SM_pll))
+            inform("Sync loop: filtered sync error %.1f (frames); estimated drift %.1f (ppm); correction %.1f (ppm); uncorrected %.2f (frames).", sync_loop.error, sync_loop.drift*1000000/frame_size, sync_loop.correction*1000000/frame_size, sync_loop.owed);
+#ifdef HAVE_LIBSOXR
+          if ((config.statistics_requested) && (resampling) && (resampler_frames))
+            inform("Resampler: %.1f CPU seconds per hour of audio.", (resampler_cpu_time*1e-9)*(44100.0*3600)/resampler_frames);
+#endif
+          if (config.statistics_requested)
+            inform("Longest time to put a packet into the buffer %.1f us; longest time for the player to wake for a packet %.1f us.", (1000000.0*__atomic_load_n(&ab_put_max,__ATOMIC_RELAXED))/((uint64_t)1<<32), (1000000.0*ab_wake_max)/((uint64_t)1<<32));
+          __atomic_store_n(&ab_put_max,0,__ATOMIC_RELAXED); // hack reset
+          ab_wake_max = 0;
           minimum_dac_queue_size=1000000; // hack reset
           maximum_buffer_occupancy = 0; // can't be less than this
-          minimum_buffer_occupancy = BUFFER_FRAMES; // can't be more than this
+          minimum_buffer_occupancy = ab_size; // can't be more than this
         }
       }
     }
   }
+#ifdef HAVE_LIBSOXR
+  if (resampling)
+    resampler_close();
+#endif
+  output_batch_write();
   free(outbuf);
   free(silence);
+  if (batch_size>1)
+    free(batch);
   return 0;
 }
 
@@ -1033,37 +1454,30 @@ void player_volume(double f) {
       config.output->volume(f);
       linear_volume=1.0; // no attenuation needed
   } 
-  pthread_mutex_lock(&vol_mutex);
-  volume = linear_volume;
-  fix_volume = 65536.0 * volume;
-  pthread_mutex_unlock(&vol_mutex);
+  // the player thread ramps to the new volume over the next packet
+  __atomic_store_n(&fix_volume,(int32_t)(SOFTVOL_UNITY*linear_volume),__ATOMIC_RELAXED);
 }
 
 void player_flush(uint32_t timestamp) {
 	// debug(1,"Flush requested up to %u. It seems as if 2147483647 is special.",timestamp);
-  pthread_mutex_lock(&flush_mutex);
-  flush_requested=1;
   //if (timestamp!=0x7fffffff)
-  flush_rtp_timestamp=timestamp; // flush all packets up to (and including?) this
-  pthread_mutex_unlock(&flush_mutex);
+  __atomic_store_n(&time_of_flush,get_absolute_time_in_fp(),__ATOMIC_RELAXED);
+  __atomic_store_n(&flush_rtp_timestamp,timestamp,__ATOMIC_RELEASE); // flush all packets up to (and including?) this
+  flush_epoch_advance();
 }
 
 int player_play(stream_cfg *stream) {
   packet_count = 0;
-  if (config.buffer_start_fill > BUFFER_FRAMES)
-    die("specified buffer starting fill %d > buffer size %d",
-      config.buffer_start_fill, BUFFER_FRAMES);
-
-#ifdef HAVE_LIBPOLARSSL
-  memset(&dctx,0,sizeof(aes_context));
-  aes_setkey_dec(&dctx, stream->aeskey, 128);
-#endif
-
-#ifdef HAVE_LIBSSL
-  AES_set_decrypt_key(stream->aeskey, 128, &aes);
-#endif
-
-  aesiv = stream->aesiv;
+  __atomic_store_n(&time_of_flush,0,__ATOMIC_RELAXED);
+
+  encrypted = stream->encrypted;
+  if (encrypted) {
+    aescbc_set_decrypt_key(&aes_key, stream->aeskey);
+    debug(2,"Decrypting audio with %s.",aescbc_implementation());
+    aesiv = stream->aesiv;
+  } else {
+    debug(2,"Audio is not encrypted.");
+  }
   init_decoder(stream->fmtp);
   // must be after decoder init
   init_buffer();
@@ -1089,7 +1503,9 @@ int player_play(stream_cfg *stream) {
 
 void player_stop(void) {
   please_stop = 1;
+  pthread_mutex_lock(&flowcontrol_mutex);
   pthread_cond_signal(&flowcontrol); // tell it to give up
+  pthread_mutex_unlock(&flowcontrol_mutex);
   pthread_join(player_thread, NULL);
   config.output->stop();
   command_stop();
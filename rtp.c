@@ -85,6 +85,7 @@ static uint64_t departure_time;  // dangerous -- this assumes that there will ne
 static pthread_mutex_t reference_time_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 uint64_t static local_to_remote_time_difference; // used to switch between local and remote clocks
+static uint64_t round_trip_time; // smoothed, from the timing pings; zero until there is one -- use the __atomic builtins on it
 
 static void *rtp_audio_receiver(void *arg) {
     // we inherit the signal mask (SIGUSR1)
@@ -329,6 +330,14 @@ static void *rtp_timing_receiver(void *arg) {
         // debug(1,"Return trip time: %lluuS, remote processing time: %lluuS.",(return_time*1000000)>>32,(processing_time*1000000)>>32); 
 
         uint64_t local_time_by_remote_clock = distant_transmit_time+return_time/2;
+
+        // smooth the round trip time as TCP does, with a gain of 1/8
+        uint64_t rtt = __atomic_load_n(&round_trip_time,__ATOMIC_RELAXED);
+        if (rtt==0)
+          rtt = return_time;
+        else
+          rtt = rtt-rtt/8+return_time/8;
+        __atomic_store_n(&round_trip_time,rtt,__ATOMIC_RELAXED);
         
         unsigned int cc;       
         for (cc=time_ping_history-1;cc>0;cc--) {
@@ -504,6 +513,7 @@ void rtp_setup(SOCKADDR *remote, int cport, int tport, uint32_t active_remote, i
 
     please_shutdown = 0;
     reference_timestamp=0;
+    __atomic_store_n(&round_trip_time,0,__ATOMIC_RELAXED);
     pthread_create(&rtp_audio_thread, NULL, &rtp_audio_receiver, NULL);
     pthread_create(&rtp_control_thread, NULL, &rtp_control_receiver, NULL);
     pthread_create(&rtp_timing_thread, NULL, &rtp_timing_receiver, NULL);
@@ -519,6 +529,10 @@ void get_reference_timestamp_stuff(uint32_t *timestamp,uint64_t *timestamp_time)
   pthread_mutex_unlock(&reference_time_mutex);
 }
 
+uint64_t rtp_round_trip_time(void) {
+  return __atomic_load_n(&round_trip_time,__ATOMIC_RELAXED);
+}
+
 void clear_reference_timestamp(void) {
   pthread_mutex_lock(&reference_time_mutex);
   reference_timestamp=0;
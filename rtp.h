@@ -12,6 +12,7 @@ void rtp_request_client_pause(void); // ask the client to pause
 
 void get_reference_timestamp_stuff(uint32_t *timestamp,uint64_t *timestamp_time);
 void clear_reference_timestamp(void); 
+uint64_t rtp_round_trip_time(void); // to the client, in fixed point seconds; zero if it isn't known yet
 
 uint64_t static local_to_remote_time_jitters;
 uint64_t static local_to_remote_time_jitters_count;
@@ -696,31 +696,37 @@ static void handle_announce(rtsp_conn_info *conn,
       cp = next;
     }
 
-    if (!paesiv || !prsaaeskey || !pfmtp) {
+    // a stream with neither an aesiv nor an rsaaeskey is sent in the clear (et=0)
+    if (!pfmtp || (!paesiv != !prsaaeskey)) {
       warn("required params missing from announce");
       goto out;
     }
 
-    int len, keylen;
-    uint8_t *aesiv = base64_dec(paesiv, &len);
-    if (len != 16) {
-      warn("client announced aeskey of %d bytes, wanted 16", len);
+    conn->stream.encrypted = (paesiv != NULL);
+    if (conn->stream.encrypted) {
+      int len, keylen;
+      uint8_t *aesiv = base64_dec(paesiv, &len);
+      if (len != 16) {
+        warn("client announced aeskey of %d bytes, wanted 16", len);
+        free(aesiv);
+        goto out;
+      }
+      memcpy(conn->stream.aesiv, aesiv, 16);
       free(aesiv);
-      goto out;
-    }
-    memcpy(conn->stream.aesiv, aesiv, 16);
-    free(aesiv);
-
-    uint8_t *rsaaeskey = base64_dec(prsaaeskey, &len);
-    uint8_t *aeskey = rsa_apply(rsaaeskey, len, &keylen, RSA_MODE_KEY);
-    free(rsaaeskey);
-    if (keylen != 16) {
-      warn("client announced rsaaeskey of %d bytes, wanted 16", keylen);
+
+      uint8_t *rsaaeskey = base64_dec(prsaaeskey, &len);
+      uint8_t *aeskey = rsa_apply(rsaaeskey, len, &keylen, RSA_MODE_KEY);
+      free(rsaaeskey);
+      if (keylen != 16) {
+        warn("client announced rsaaeskey of %d bytes, wanted 16", keylen);
+        free(aeskey);
+        goto out;
+      }
+      memcpy(conn->stream.aeskey, aeskey, 16);
       free(aeskey);
-      goto out;
+    } else {
+      debug(1,"Unencrypted stream announced.");
     }
-    memcpy(conn->stream.aeskey, aeskey, 16);
-    free(aeskey);
 
     int i;
     for (i=0; i<sizeof(conn->stream.fmtp)/sizeof(conn->stream.fmtp[0]); i++)
@@ -970,6 +976,7 @@ static void *rtsp_conversation_thread_func(void *pconn) {
     do {
       reply=rtsp_read_request(conn->fd,&req);
       if (reply==rtsp_read_request_response_ok) {
+        uint64_t time_of_request = get_absolute_time_in_fp();
         resp = msg_init();
         resp->respcode = 400;
 
@@ -996,6 +1003,11 @@ static void *rtsp_conversation_thread_func(void *pconn) {
 
 respond:
         msg_write_response(conn->fd, resp);
+        // the key exchange is in OPTIONS and ANNOUNCE, and it all comes before the first sound
+        if ((!strcmp(req->method,"OPTIONS")) || (!strcmp(req->method,"ANNOUNCE"))) {
+          uint64_t time_taken = get_absolute_time_in_fp()-time_of_request;
+          debug(2,"%s handled in %.3f ms.",req->method,(time_taken*1000.0)/((uint64_t)1<<32));
+        }
         msg_free(req);
         msg_free(resp);
       } else {
@@ -180,7 +180,19 @@ void usage(char *progname) {
     printf("    -t, --timeout=SECONDS   go back to idle mode from play mode after a break in communications of this many seconds (default 120). Set to 0 never to exit play mode.\n");
     printf("    --statistics            print some interesting statistics -- output to the logfile if running as a daemon.\n");
     printf("    --tolerance=TOLERANCE   allow a synchronization error of TOLERANCE frames (default 88) before trying to correct it.\n");
+    printf("    --sync-mode=MODE        set how to keep in sync with the source\n");
+    printf("                            \"threshold\" (default) corrects the synchronization error when it goes beyond the tolerance.\n");
+    printf("                            \"pll\" tracks the drift between the source and the output device and corrects for it continuously.\n");
     printf("    --password=PASSWORD     require PASSWORD to connect. Default is not to require a password.\n");
+    printf("    --buffer-packets=PACKETS  make the audio buffer hold PACKETS packets of audio (default 512), rounded up to a power of two.\n");
+    printf("                            The buffer is enlarged if necessary to hold the latency.\n");
+    printf("    --lock-buffer           lock the audio buffer into memory, so that it is never paged out.\n");
+    printf("    --decode-on-play        keep audio packets in the buffer as received and decode them just before they are played.\n");
+    printf("                            This uses less memory and does no work for audio that is flushed when skipping tracks.\n");
+    printf("    --output-thread         pass audio to the output from a thread of its own, so that the player never waits for it.\n");
+    printf("                            This also lets outputs that can't report their delay, such as pipe, be kept in sync.\n");
+    printf("    --output-batch          write the audio to the output a few packets at a time rather than one at a time,\n");
+    printf("                            so that the player wakes up and writes to the output less often.\n");
     printf("\n");
     mdns_ls_backends();
     printf("\n");
@@ -191,6 +203,7 @@ int parse_options(int argc, char **argv) {
   signed char    c;            /* used for argument parsing */
   int     i = 0;        /* used for tracking options */
   char    *stuffing = NULL;  /* used for picking up the stuffing option */
+  char    *sync_mode = NULL;  /* used for picking up the sync-mode option */
   poptContext optCon;   /* context for parsing command-line options */
   struct poptOption optionsTable[] = {
     { "statistics", 0, POPT_ARG_NONE, &config.statistics_requested, 0, NULL},
@@ -216,7 +229,13 @@ int parse_options(int argc, char **argv) {
     { "timeout", 't', POPT_ARG_INT, &config.timeout, 0, NULL } ,
     { "password", 0, POPT_ARG_STRING, &config.password, 0, NULL } ,
     { "tolerance", 0, POPT_ARG_INT, &config.tolerance, 0, NULL } ,
+    { "sync-mode", 0, POPT_ARG_STRING, &sync_mode, 's', NULL } ,
     { "meta-dir", 'M', POPT_ARG_STRING, &config.meta_dir, 0, NULL } ,
+    { "buffer-packets", 0, POPT_ARG_INT, &config.buffer_packets, 0, NULL } ,
+    { "lock-buffer", 0, POPT_ARG_NONE, &config.lock_buffer, 0, NULL } ,
+    { "decode-on-play", 0, POPT_ARG_NONE, &config.decode_on_play, 0, NULL } ,
+    { "output-thread", 0, POPT_ARG_NONE, &config.output_thread, 0, NULL } ,
+    { "output-batch", 0, POPT_ARG_NONE, &config.output_batch, 0, NULL } ,
     POPT_AUTOHELP
     { NULL, 0, 0, NULL, 0 }
   };
@@ -248,11 +267,21 @@ int parse_options(int argc, char **argv) {
         else
           die("Illegal stuffing option \"%s\" -- must be \"basic\" or \"soxr\"",stuffing);
         break;
+      case 's':
+        if (strcmp(sync_mode,"threshold")==0)
+          config.sync_mode = SM_threshold;
+        else if (strcmp(sync_mode,"pll")==0)
+          config.sync_mode = SM_pll;
+        else
+          die("Illegal sync-mode option \"%s\" -- must be \"threshold\" or \"pll\"",sync_mode);
+        break;
     }
   }
   if (c < -1) {
     die("%s: %s",poptBadOption(optCon, POPT_BADOPTION_NOALIAS),poptStrerror(c));
   }
+  if ((config.buffer_packets<16) || (config.buffer_packets>16384))
+    die("the audio buffer must hold from 16 to 16384 packets, not %d",config.buffer_packets);
   /* Print out options */
   
   debug(2,"statistics_requester status is %d.",config.statistics_requested);
@@ -272,8 +301,14 @@ int parse_options(int argc, char **argv) {
   debug(2,"resync time is %d.",config.resyncthreshold);
   debug(2,"busy timeout time is %d.",config.timeout);
   debug(2,"tolerance is %d frames.",config.tolerance);
+  debug(2,"sync mode option is \"%s\".",sync_mode);
   debug(2,"password is \"%s\".",config.password);
   debug(2,"metadata directory is \"%s\".",config.meta_dir);
+  debug(2,"audio buffer size is %d packets.",config.buffer_packets);
+  debug(2,"lock-buffer status is %d.",config.lock_buffer);
+  debug(2,"decode-on-play status is %d.",config.decode_on_play);
+  debug(2,"output-thread status is %d.",config.output_thread);
+  debug(2,"output-batch status is %d.",config.output_batch);
 
   return optind+1;
 }
@@ -355,8 +390,10 @@ int main(int argc, char **argv) {
     config.timeout = 120; // this number of seconds to wait for [more] audio before switching to idle.
     config.tolerance = 88; // this number of frames of error before attempting to correct it.
     config.buffer_start_fill = 220;
+    config.buffer_packets = 512;
     config.port = 5000;
     config.packet_stuffing = ST_basic; // simple interpolation or deletion
+    config.sync_mode = SM_threshold;
     char hostname[100];
     gethostname(hostname, 100);
     config.apname = malloc(20 + 100);
@@ -513,6 +550,8 @@ int main(int argc, char **argv) {
         die("Invalid audio output specified!");
     }
     config.output->init(argc-audio_arg, argv+audio_arg);
+    if (config.output_thread)
+        config.output = audio_buffered(config.output);
 
     daemon_log(LOG_NOTICE, "startup");
 
@@ -533,6 +572,7 @@ int main(int argc, char **argv) {
 #endif
     memcpy(config.hw_addr, ap_md5, sizeof(config.hw_addr));
 
+    rsa_key_init();
     rtsp_listen_loop();
 
     // should not reach this...
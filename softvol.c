@@ -0,0 +1,233 @@
+/*
+ * Software volume control. This file is part of Shairport Sync.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "softvol.h"
+
+/* SSE2 is always there on x86-64, and NEON on ARMv8, so the vector code
+ * is simply built when the compiler targets it. */
+#if defined(__SSE2__)
+#define SOFTVOL_HAVE_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SOFTVOL_HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+/* Samples are multiplied by the gain in 1.15 fixed point, so that a sample
+ * times the gain plus the dither fits in 32 bits -- and in one SSE2 pmaddwd.
+ * Unity gain doesn't fit, but it needs no multiply and no dither, and a ramp
+ * towards it stops just short of it, at -0.0003 dB.
+ *
+ * The dither is triangular, the sum of two uniform 15-bit random numbers.
+ * They come from eight xorshift generators, one for each sample of a block
+ * of eight, so that the vector code can run them side by side.
+ *
+ * The gain of each frame is kept in 15.16 fixed point, so that a ramp can
+ * move by less than one step of the gain per frame. */
+
+static inline uint32_t xorshift(uint32_t x) {
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+static inline int32_t tpdf(uint32_t x) {
+  return (int32_t)(x & 0x7fff) + (int32_t)((x >> 16) & 0x7fff) - 0x7fff;
+}
+
+static inline short gain_sample(short sample, int32_t gain, int32_t dither) {
+  int32_t out = ((int32_t)sample * gain + dither + 0x4000) >> 15;
+  if (out > 32767)
+    out = 32767;
+  if (out < -32768)
+    out = -32768;
+  return out;
+}
+
+// gain is that of the first frame, and step is added to it for each frame after
+static void apply_generic(uint32_t *lanes, short *out, const short *in, int samples, uint32_t gain, int32_t step) {
+  int i, j;
+  for (i = 0; i < samples; i += 8) {
+    for (j = 0; j < 8; j++)
+      lanes[j] = xorshift(lanes[j]);
+    for (j = 0; (j < 8) && (i + j < samples); j++) {
+      uint32_t g = (gain + (uint32_t)step * ((i + j) / 2)) >> 16;
+      if (g > 0x7fff)
+        g = 0x7fff;
+      out[i + j] = gain_sample(in[i + j], g, tpdf(lanes[j]));
+    }
+  }
+}
+
+#ifdef SOFTVOL_HAVE_SSE2
+static inline __m128i xorshift_sse2(__m128i x) {
+  x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+  x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+  x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+  return x;
+}
+
+static inline __m128i tpdf_sse2(__m128i x) {
+  const __m128i mask = _mm_set1_epi32(0x7fff);
+  __m128i sum = _mm_add_epi32(_mm_and_si128(x, mask), _mm_and_si128(_mm_srli_epi32(x, 16), mask));
+  return _mm_sub_epi32(sum, mask);
+}
+
+static void apply_sse2(uint32_t *lanes, short *out, const short *in, int samples, uint32_t gain, int32_t step) {
+  const __m128i round = _mm_set1_epi32(0x4000);
+  const __m128i ones = _mm_set1_epi16(1);
+  const __m128i increment = _mm_set1_epi32(4 * step);
+  __m128i state_a = _mm_load_si128((__m128i *)lanes);
+  __m128i state_b = _mm_load_si128((__m128i *)(lanes + 4));
+  __m128i gains = _mm_setr_epi32(gain, gain + step, gain + 2 * step, gain + 3 * step);
+  int blocks = samples / 8, b;
+
+  for (b = 0; b < blocks; b++) {
+    state_a = xorshift_sse2(state_a);
+    state_b = xorshift_sse2(state_b);
+    __m128i dither = _mm_packs_epi32(tpdf_sse2(state_a), tpdf_sse2(state_b));
+
+    // the gains of the four frames, saturated to 0x7fff, one for each sample
+    __m128i g = _mm_srli_epi32(gains, 16);
+    g = _mm_packs_epi32(g, g);
+    g = _mm_unpacklo_epi16(g, g);
+
+    // pmaddwd of (sample, dither) and (gain, 1)
+    __m128i s = _mm_loadu_si128((const __m128i *)(in + 8 * b));
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(s, dither), _mm_unpacklo_epi16(g, ones));
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(s, dither), _mm_unpackhi_epi16(g, ones));
+    lo = _mm_srai_epi32(_mm_add_epi32(lo, round), 15);
+    hi = _mm_srai_epi32(_mm_add_epi32(hi, round), 15);
+    _mm_storeu_si128((__m128i *)(out + 8 * b), _mm_packs_epi32(lo, hi));
+
+    gains = _mm_add_epi32(gains, increment);
+  }
+  _mm_store_si128((__m128i *)lanes, state_a);
+  _mm_store_si128((__m128i *)(lanes + 4), state_b);
+
+  apply_generic(lanes, out + 8 * blocks, in + 8 * blocks, samples - 8 * blocks,
+                gain + (uint32_t)step * 4 * blocks, step);
+}
+#endif
+
+#ifdef SOFTVOL_HAVE_NEON
+static inline uint32x4_t xorshift_neon(uint32x4_t x) {
+  x = veorq_u32(x, vshlq_n_u32(x, 13));
+  x = veorq_u32(x, vshrq_n_u32(x, 17));
+  x = veorq_u32(x, vshlq_n_u32(x, 5));
+  return x;
+}
+
+static inline int16x4_t tpdf_neon(uint32x4_t x) {
+  const uint32x4_t mask = vdupq_n_u32(0x7fff);
+  uint32x4_t sum = vaddq_u32(vandq_u32(x, mask), vandq_u32(vshrq_n_u32(x, 16), mask));
+  return vqmovn_s32(vsubq_s32(vreinterpretq_s32_u32(sum), vdupq_n_s32(0x7fff)));
+}
+
+static void apply_neon(uint32_t *lanes, short *out, const short *in, int samples, uint32_t gain, int32_t step) {
+  const int32x4_t round = vdupq_n_s32(0x4000);
+  const uint32x4_t increment = vdupq_n_u32(4 * step);
+  uint32x4_t state_a = vld1q_u32(lanes);
+  uint32x4_t state_b = vld1q_u32(lanes + 4);
+  uint32_t first_gains[4] = {gain, gain + step, gain + 2 * step, gain + 3 * step};
+  uint32x4_t gains = vld1q_u32(first_gains);
+  int blocks = samples / 8, b;
+
+  for (b = 0; b < blocks; b++) {
+    state_a = xorshift_neon(state_a);
+    state_b = xorshift_neon(state_b);
+
+    // the gains of the four frames, saturated to 0x7fff, one for each sample
+    int16x4_t g = vqmovn_s32(vreinterpretq_s32_u32(vshrq_n_u32(gains, 16)));
+    int16x4x2_t g2 = vzip_s16(g, g);
+
+    int16x8_t s = vld1q_s16(in + 8 * b);
+    int32x4_t lo = vmlal_s16(vmovl_s16(tpdf_neon(state_a)), vget_low_s16(s), g2.val[0]);
+    int32x4_t hi = vmlal_s16(vmovl_s16(tpdf_neon(state_b)), vget_high_s16(s), g2.val[1]);
+    lo = vaddq_s32(lo, round);
+    hi = vaddq_s32(hi, round);
+    vst1q_s16(out + 8 * b, vcombine_s16(vqshrn_n_s32(lo, 15), vqshrn_n_s32(hi, 15)));
+
+    gains = vaddq_u32(gains, increment);
+  }
+  vst1q_u32(lanes, state_a);
+  vst1q_u32(lanes + 4, state_b);
+
+  apply_generic(lanes, out + 8 * blocks, in + 8 * blocks, samples - 8 * blocks,
+                gain + (uint32_t)step * 4 * blocks, step);
+}
+#endif
+
+void softvol_dither_init(softvol_dither *dither) {
+  int i;
+  for (i = 0; i < 8; i++)
+    dither->lanes[i] = 0x9e3779b9 * (i + 1); // any seeds will do, as long as they're not zero
+}
+
+void softvol_apply(softvol_dither *dither, short *out, const short *in, int frames, int32_t gain_from, int32_t gain_to) {
+  if (frames <= 0)
+    return;
+  if (gain_from < 0)
+    gain_from = 0;
+  if (gain_from > SOFTVOL_UNITY)
+    gain_from = SOFTVOL_UNITY;
+  if (gain_to < 0)
+    gain_to = 0;
+  if (gain_to > SOFTVOL_UNITY)
+    gain_to = SOFTVOL_UNITY;
+
+  if ((gain_from == SOFTVOL_UNITY) && (gain_to == SOFTVOL_UNITY)) {
+    if (out != in)
+      memmove(out, in, frames * 4);
+    return;
+  }
+  if ((gain_from == 0) && (gain_to == 0)) { // muted -- not even the dither
+    memset(out, 0, frames * 4);
+    return;
+  }
+
+  uint32_t gain = (uint32_t)(gain_from >> 1) << 16;
+  int32_t step = (int32_t)((((int64_t)(gain_to >> 1) - (gain_from >> 1)) << 16) / frames);
+#if defined(SOFTVOL_HAVE_SSE2)
+  apply_sse2(dither->lanes, out, in, frames * 2, gain, step);
+#elif defined(SOFTVOL_HAVE_NEON)
+  apply_neon(dither->lanes, out, in, frames * 2, gain, step);
+#else
+  apply_generic(dither->lanes, out, in, frames * 2, gain, step);
+#endif
+}
+
+const char *softvol_implementation(void) {
+#if defined(SOFTVOL_HAVE_SSE2)
+  return "SSE2";
+#elif defined(SOFTVOL_HAVE_NEON)
+  return "NEON";
+#else
+  return "C";
+#endif
+}
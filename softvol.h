@@ -0,0 +1,26 @@
+#ifndef _SOFTVOL_H
+#define _SOFTVOL_H
+
+#include <stdint.h>
+
+// Software volume control for interleaved stereo 16-bit audio, with TPDF dither.
+// SSE2 or NEON is used where the compiler targets it, otherwise plain C;
+// all of them give exactly the same output.
+
+// gains are 16.16 fixed point, from 0 to SOFTVOL_UNITY
+#define SOFTVOL_UNITY 0x10000
+
+typedef struct {
+  uint32_t lanes[8] __attribute__((aligned(16))); // state of the dither generator
+} softvol_dither;
+
+void softvol_dither_init(softvol_dither *dither);
+
+// Apply the gain to frames stereo frames from in, leaving the result in out -- which may be the same as in.
+// The gain ramps from gain_from at the start to gain_to at the end, so that a change is free of clicks.
+void softvol_apply(softvol_dither *dither, short *out, const short *in, int frames, int32_t gain_from, int32_t gain_to);
+
+// the name of the implementation in use
+const char *softvol_implementation(void);
+
+#endif // _SOFTVOL_H
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Decodes the test packets with the filter kernels picked for this processor,
+# and with only the plain C code, and checks that both give the right audio.
+# The checksum is that of the PCM the packets were encoded from.
+
+expected=9104869d3b266794
+corpus="${srcdir:-.}/tests/alac.corpus"
+status=0
+
+for bench in ./shairport-bench ./shairport-bench-generic; do
+  output=`$bench -i 1 "$corpus"` || exit 1
+  decoder=`echo "$output" | sed -n 's/^decoder: *//p'`
+  checksum=`echo "$output" | sed -n 's/^pcm checksum: *//p'`
+  if [ "$checksum" = "$expected" ]; then
+    echo "$bench ($decoder): ok"
+  else
+    echo "$bench ($decoder): pcm checksum $checksum, expected $expected"
+    status=1
+  fi
+done
+exit $status